@@ -44,6 +44,7 @@
 #define __OPENCV_ONLINE_BOOSTING_H__
 
 #include <opencv2/core/core.hpp>
+#include <iosfwd>
 
 namespace cv
 {
@@ -59,7 +60,7 @@ namespace cv
       defaultInit(const cv::Mat & image, Size imageSize);
 
       int
-      getSum(Rect imageROI);
+      getSum(Rect imageROI) const;
       float
       getMean(Rect imagROI);
       unsigned int
@@ -70,12 +71,49 @@ namespace cv
       setNewImageSize(Rect ROI);
       void
       setNewImageAndROI(const cv::Mat & image, Rect ROI);
+      // incremental versions for images that changed only partially since the previous call: the integral
+      // tables are kept as long as they cover the ROI and only the part affected by the changed region is updated
+      void
+      setNewImageAndROI(const cv::Mat & image, Rect ROI, Rect changedRect);
+      void
+      setNewImageAndROI(const cv::Mat & image, Rect ROI, const cv::Mat & changedMask);
       float
       getVariance(Rect imageROI);
-      long
-      getSqSum(Rect imageROI);
+      // variances of a regular grid of patches, kept until the integrals change
+      const cv::Mat_<float> &
+      getVarianceMap(Rect firstPatch, Size step, Size grid);
+      // uncached variance, safe to call from several threads
+      float
+      computeVariance(Rect imageROI) const;
+      int64
+      getSqSum(Rect imageROI) const;
+      // responses of the Haar features evaluated since the integrals last changed, keyed by feature id and ROI;
+      // only used by the training path if enabled, as it is not thread-safe
+      bool
+      getCachedResponse(uint64 featureId, Rect imageROI, float* response);
+      void
+      setCachedResponse(uint64 featureId, Rect imageROI, float response);
+      // direct access to the sum integral for precompiled feature evaluation
+      int
+      getIntegralStep() const
+      {
+        return (int) (intImage.step / sizeof(int));
+      }
+      ;
+      const int*
+      getIntegralPtr(cv::Point2i imagePosition) const
+      {
+        return &intImage(imagePosition.y - m_offset.y, imagePosition.x - m_offset.x);
+      }
+      ;
       bool
-      getUseVariance()
+      isInsideIntegral(Rect imageROI) const
+      {
+        return !intImage.empty() && (imageROI & m_ROI) == imageROI;
+      }
+      ;
+      bool
+      getUseVariance() const
       {
         return m_useVariance;
       }
@@ -84,26 +122,78 @@ namespace cv
       setUseVariance(bool useVariance)
       {
         this->m_useVariance = useVariance;
+        invalidateCaches();
+      }
+      ;
+      // pays off if the same patches are evaluated with the same features several times per frame, off by default
+      bool
+      getUseResponseCache() const
+      {
+        return m_useResponseCache;
+      }
+      ;
+      void
+      setUseResponseCache(bool useResponseCache)
+      {
+        this->m_useResponseCache = useResponseCache;
+        invalidateCaches();
       }
       ;
 
     private:
 
       bool m_useVariance;
+      bool m_useResponseCache;
       void
       createIntegralsOfROI(const cv::Mat & image);
+      void
+      updateIntegralsOfROI(const cv::Mat & image, Rect changedRect);
+      void
+      invalidateCaches();
+      int
+      findResponseSlot(Rect imageROI, bool create);
 
       cv::Size m_imageSize;
-      cv::Mat_<int> intImage;
-      cv::Mat_<double> intSqImage;
+      cv::Mat_<int> intImage; // sum integral, (h+1)x(w+1) view into row-padded storage
+      cv::Mat intSqImage; // squared sum integral as 64-bit integers, same layout as intImage
       Rect m_ROI;
       cv::Point2i m_offset;
+
+      // variance of the last patch asked for and of the last grid of patches
+      bool m_varianceValid;
+      Rect m_varianceROI;
+      float m_variance;
+      bool m_varianceMapValid;
+      Rect m_varianceMapPatch;
+      Size m_varianceMapStep;
+      cv::Mat_<float> m_varianceMap;
+
+      // open addressing table of the feature responses of one ROI
+      struct ResponseSlot
+      {
+        Rect ROI;
+        int generation; // entries of older generations are stale
+        int numEntries;
+        std::vector<uint64> ids;
+        std::vector<int> generations;
+        std::vector<float> responses;
+      };
+      std::vector<ResponseSlot> m_responseSlots;
+      int m_numResponseSlots; // slots in use since the integrals last changed
+      int m_nextResponseSlot; // slot to be replaced next once all are in use
+      int m_lastResponseSlot; // slot of the last lookup
     };
 
     class Patches
     {
     public:
 
+      // the corners of the scanned region, and a random patch
+      enum SpecialRect
+      {
+        UPPER_LEFT, UPPER_RIGHT, LOWER_LEFT, LOWER_RIGHT, RANDOM
+      };
+
       Patches();
       Patches(int num);
       virtual
@@ -115,9 +205,9 @@ namespace cv
       virtual Rect
       getRect(int index);
       virtual Rect
-      getSpecialRect(const char* what);
+      getSpecialRect(SpecialRect what);
       virtual Rect
-      getSpecialRect(const char* what, Size patchSize);
+      getSpecialRect(SpecialRect what, Size patchSize);
 
       virtual Rect
       getROI();
@@ -128,6 +218,10 @@ namespace cv
       }
       ;
 
+      // distinct sizes of the patches
+      virtual std::vector<Size>
+      getPatchSizes();
+
       int
       checkOverlap(Rect rect);
 
@@ -167,27 +261,36 @@ namespace cv
       virtual
       ~PatchesRegularScan(void);
 
+      // the patches are not stored, they are computed from their position in the grid
+      Rect
+      getRect(int index);
       Rect
-      getSpecialRect(const char* what);
+      getSpecialRect(SpecialRect what);
       Rect
-      getSpecialRect(const char* what, Size patchSize);
+      getSpecialRect(SpecialRect what, Size patchSize);
+      std::vector<Size>
+      getPatchSizes();
       cv::Size
       getPatchGrid()
       {
         return m_patchGrid;
       }
       ;
+      cv::Size
+      getPatchStep()
+      {
+        return m_patchStep;
+      }
+      ;
 
     private:
 
       void
       calculatePatches(Rect imageROI, Rect validROI, Size patchSize, float relOverlap);
 
-      Rect m_rectUpperLeft;
-      Rect m_rectUpperRight;
-      Rect m_rectLowerLeft;
-      Rect m_rectLowerRight;
+      cv::Size m_patchSize;
       cv::Size m_patchGrid;
+      cv::Size m_patchStep;
 
     };
 
@@ -203,9 +306,9 @@ namespace cv
       ~PatchesRegularScaleScan();
 
       Rect
-      getSpecialRect(const char* what);
+      getSpecialRect(SpecialRect what);
       Rect
-      getSpecialRect(const char* what, Size patchSize);
+      getSpecialRect(SpecialRect what, Size patchSize);
 
     private:
 
@@ -232,9 +335,9 @@ namespace cv
       ~PatchesFunctionScaleScan();
 
       Rect
-      getSpecialRect(const char* what);
+      getSpecialRect(SpecialRect what);
       Rect
-      getSpecialRect(const char* what, Size patchSize);
+      getSpecialRect(SpecialRect what, Size patchSize);
 
     private:
 
@@ -260,13 +363,13 @@ namespace cv
       ~PatchesManualSet(void);
 
       Rect
-      getSpecialRect(const char* what)
+      getSpecialRect(SpecialRect what)
       {
         return Rect(-1, -1, -1, -1);
       }
       ;
       Rect
-      getSpecialRect(const char* what, cv::Size patchSize)
+      getSpecialRect(SpecialRect what, cv::Size patchSize)
       {
         return Rect(-1, -1, -1, -1);
       }
@@ -282,8 +385,9 @@ namespace cv
       virtual
       ~EstimatedGaussDistribution();
 
+      // numUpdates repeated updates with the same value
       void
-      update(float value); //, float timeConstant = -1.0);
+      update(float value, int numUpdates = 1); //, float timeConstant = -1.0);
 
       float
       getMean()
@@ -315,13 +419,56 @@ namespace cv
 
     public:
 
-      FeatureHaar(Size patchSize);
+      FeatureHaar(Size patchSize, cv::RNG & rng);
+      // empty feature to be read from a snapshot
+      FeatureHaar();
 
       void
       getInitialDistribution(EstimatedGaussDistribution *distribution);
+      float
+      getInitMean()
+      {
+        return m_initMean;
+      }
+      ;
+      float
+      getInitSigma()
+      {
+        return m_initSigma;
+      }
+      ;
+
+      // areas of the feature scaled to one patch size
+      struct ScaledLayout
+      {
+        Size patchSize;
+        bool valid; // false if an area gets smaller than the minimum size
+        std::vector<Rect> areas;
+        std::vector<float> weights;
+        Rect bounds; // bounding box of the areas
+        std::vector<int> cornerOffsets; // integral offsets of the corners of the areas (tl, tr, bl, br)
+        int compiledStep; // integral row step cornerOffsets were computed for, -1 if not computed yet
+      };
+
+      // scales the feature to all patch sizes of a scan in advance, and computes the corner offsets for the
+      // integral step if it is given
+      void
+      prepareScales(const std::vector<Size> & patchSizes, int integralStep = -1);
 
       bool
       eval(ImageRepresentation* image, Rect ROI, float* result);
+      // bypasses the caches of the image, which is only read, so different features can be evaluated in parallel
+      bool
+      evalUncached(const ImageRepresentation* image, Rect ROI, float variance, float* result);
+
+      // thread-safe versions, patch sizes the feature has not been prepared for are scaled into scratch
+      bool
+      eval(const ImageRepresentation* image, Rect ROI, float variance, ScaledLayout & scratch, float* result) const;
+      // evaluates numPatches patches of equal size, starting with firstPatch and shifted by stepCol pixels each,
+      // variances holds the variance of every patch if the image representation uses variance normalization
+      bool
+      evalRow(const ImageRepresentation* image, Rect firstPatch, int stepCol, int numPatches, const float* variances,
+              ScaledLayout & scratch, float* results) const;
 
       float
       getResponse()
@@ -348,9 +495,29 @@ namespace cv
         return m_areas;
       }
       ;
+      // replaces the feature by a new random one in place, reusing the memory of this one
+      void
+      regenerate(Size patchSize, cv::RNG & rng);
+      void
+      swap(FeatureHaar & other);
+
+      // geometry and initial distribution of the feature, see BoostingTracker::write
+      void
+      write(std::ostream & os) const;
+      bool
+      read(std::istream & is);
+
+      // unique per generated feature, copies share it; 64 bits, so it does not wrap in the lifetime of a process
+      uint64
+      getId() const
+      {
+        return m_id;
+      }
+      ;
 
     private:
 
+      uint64 m_id;
       int m_type;
       int m_numAreas;
       std::vector<int> m_weights;
@@ -358,123 +525,187 @@ namespace cv
       float m_initSigma;
 
       void
-      generateRandomFeature(Size imageSize);
+      generateRandomFeature(Size imageSize, cv::RNG & rng);
+      void
+      resetLayouts();
+      void
+      scaleLayout(ScaledLayout & layout, Size patchSize) const;
+      void
+      compileLayout(ScaledLayout & layout, int integralStep) const;
+      bool
+      scaleToPatchSize(Size patchSize);
+      const ScaledLayout*
+      getLayout(Size patchSize, int integralStep, ScaledLayout & scratch) const;
+      float
+      sumAreas(const ImageRepresentation* image, const ScaledLayout & layout, cv::Point2i offset) const;
       std::vector<Rect> m_areas; // areas within the patch over which to compute the feature
       cv::Size m_initSize; // size of the patch used during training
-      cv::Size m_curSize; // size of the patches currently under investigation
-      float m_scaleFactorHeight; // scaling factor in vertical direction
-      float m_scaleFactorWidth; // scaling factor in horizontal direction
-      std::vector<Rect> m_scaleAreas; // areas after scaling
-      std::vector<float> m_scaleWeights; // weights after scaling
+      std::vector<ScaledLayout> m_layouts; // layouts of the recently used patch sizes, the first one is m_initSize
+      int m_numLayouts; // layouts in use, the others are kept to reuse their memory
+      int m_curLayout; // layout of the patches currently under investigation
+      int m_nextLayout; // layout to be replaced next once the cache is full
       float m_response;
 
     };
 
-    class ClassifierThreshold
+    // scratch memory of one thread for the const evaluation of the classifiers
+    class EvalScratch
     {
     public:
 
-      ClassifierThreshold();
-      virtual
-      ~ClassifierThreshold();
-
-      void
-      update(float value, int target);
-      int
-      eval(float value);
-
-      void*
-      getDistribution(int target);
-
-    private:
-
-      EstimatedGaussDistribution* m_posSamples;
-      EstimatedGaussDistribution* m_negSamples;
-
-      float m_threshold;
-      int m_parity;
+      FeatureHaar::ScaledLayout layout; // layout of a patch size the features have not been prepared for
+      std::vector<float> values; // feature values of a row of patches
     };
 
-    class WeakClassifier
+    // The Haar feature weak classifiers of a base classifier, shared by all base classifiers of the direct
+    // selection. The features are kept in one array, and the statistics of their thresholds in arrays of their own,
+    // so learning a sample runs as flat loops over all weak classifiers.
+    class WeakClassifierPool
     {
-
     public:
 
-      WeakClassifier();
-      virtual
-      ~WeakClassifier();
-
-      virtual bool
-      update(ImageRepresentation* image, Rect ROI, int target);
+      // the features are drawn from rng, also when they are replaced; without randomFeatures they are left empty
+      // for read
+      WeakClassifierPool(int numWeakClassifier, Size patchSize, cv::RNG & rng, bool randomFeatures = true);
 
-      virtual int
-      eval(ImageRepresentation* image, Rect ROI);
-
-      virtual float
-      getValue(ImageRepresentation* image, Rect ROI);
+      // learns the sample numUpdates times with every weak classifier and marks the ones which classify it wrong
+      // afterwards, invalid features always count as wrong; the feature values of sample batchSample of the
+      // prepared batch are used if it is given
+      void
+      update(ImageRepresentation* image, Rect ROI, int target, int numUpdates, bool* errorMask,
+             int batchSample = -1);
 
-      virtual int
-      getType();
+      // evaluates all features for a batch of samples in one pass, features replaced later on are evaluated again
+      void
+      prepareBatch(ImageRepresentation* image, const std::vector<Rect> & ROIs);
+      void
+      clearBatch();
+      // vote of weak classifier idx for sample batchSample of the prepared batch
+      int
+      evalBatchSample(int idx, int batchSample) const;
 
-    };
+      int
+      eval(int idx, ImageRepresentation* image, Rect ROI);
+      // thread-safe evaluation, variance is the variance of the patch if the image uses variance normalization
+      int
+      eval(int idx, const ImageRepresentation* image, Rect ROI, float variance, EvalScratch & scratch) const;
+      // adds the votes weighted with alpha for a regular grid of patches, confidences and variances (if not NULL)
+      // have the size of the grid
+      void
+      evalGrid(int idx, const ImageRepresentation* image, Rect firstPatch, Size step, float alpha,
+               const cv::Mat_<float>* variances, cv::Mat_<float> & confidences, EvalScratch & scratch) const;
 
-    class WeakClassifierHaarFeature: public WeakClassifier
-    {
+      float
+      getValue(int idx, ImageRepresentation* image, Rect ROI);
 
-    public:
+      void
+      prepareScales(int idx, const std::vector<Size> & patchSizes, int integralStep);
 
-      WeakClassifierHaarFeature(Size patchSize);
-      virtual
-      ~WeakClassifierHaarFeature();
+      // moves weak classifier source to target and puts a new random one in its place
+      void
+      replace(int target, int source, Size patchSize);
 
+      // features and statistics, read returns false if the pool has a different size
+      void
+      write(std::ostream & os) const;
       bool
-      update(ImageRepresentation* image, Rect ROI, int target);
+      read(std::istream & is);
 
       int
-      eval(ImageRepresentation* image, Rect ROI);
-
+      getNumWeakClassifier()
+      {
+        return static_cast<int>(m_features.size());
+      }
+      ;
+      const FeatureHaar &
+      getFeature(int idx) const
+      {
+        return m_features[idx];
+      }
+      ;
       float
-      getValue(ImageRepresentation* image, Rect ROI);
-
-      int
-      getType()
+      getThreshold(int idx) const
       {
-        return 1;
+        return m_threshold[idx];
+      }
+      ;
+      float
+      getParity(int idx) const
+      {
+        return m_parity[idx];
+      }
+      ;
+      // random number generator of the tracker, also used for the poisson sampling of the updates
+      cv::RNG &
+      getRNG()
+      {
+        return *m_rng;
       }
       ;
 
-      EstimatedGaussDistribution*
-      getPosDistribution();
-      EstimatedGaussDistribution*
-      getNegDistribution();
+    private:
 
+      int
+      classify(int idx, float value) const
+      {
+        return (((m_parity[idx] * (value - m_threshold[idx])) > 0) ? 1 : -1);
+      }
+      ;
       void
-      resetPosDist();
+      initStatistics(int idx);
       void
-      initPosDist();
-
-    private:
-
-      FeatureHaar* m_feature;
-      ClassifierThreshold* m_classifier;
-
+      evalBatch(int idx);
       void
-      generateRandomClassifier();
-
+      updateDistributions(int begin, int end, int target, int numUpdates);
+      void
+      updateThresholds(int begin, int end, int target, bool* errorMask);
+
+      cv::RNG* m_rng;
+      std::vector<FeatureHaar> m_features;
+
+      // kalman filtered gaussian distributions of the feature values of the positive and negative samples
+      std::vector<float> m_posMean;
+      std::vector<float> m_posSigma;
+      std::vector<float> m_posPMean;
+      std::vector<float> m_posPSigma;
+      std::vector<float> m_negMean;
+      std::vector<float> m_negSigma;
+      std::vector<float> m_negPMean;
+      std::vector<float> m_negPSigma;
+
+      std::vector<float> m_threshold;
+      std::vector<float> m_parity; // 1 or -1, 0 before the first update
+
+      std::vector<float> m_values; // feature values of the sample being learned
+      std::vector<unsigned char> m_valid;
+
+      ImageRepresentation* m_batchImage; // NULL if no batch is prepared
+      std::vector<Rect> m_batchROIs; // distinct ROIs of the batch
+      std::vector<int> m_batchSampleROI; // ROI of every sample of the batch
+      std::vector<float> m_batchVariances; // variances of the ROIs
+      std::vector<float> m_batchValues; // a row of feature values of the ROIs per weak classifier
+      std::vector<unsigned char> m_batchValid;
     };
 
     class BaseClassifier
     {
     public:
 
-      BaseClassifier(int numWeakClassifier, int iterationInit, Size patchSize);
-      BaseClassifier(int numWeakClassifier, int iterationInit, WeakClassifier** weakClassifier);
+      BaseClassifier(int numWeakClassifier, int iterationInit, Size patchSize, cv::RNG & rng,
+                     bool randomFeatures = true);
+      BaseClassifier(int numWeakClassifier, int iterationInit, WeakClassifierPool* weakClassifier);
 
       virtual
       ~BaseClassifier();
 
       void
-      trainClassifier(ImageRepresentation* image, Rect ROI, int target, float importance, bool* errorMask);
+      trainClassifier(ImageRepresentation* image, Rect ROI, int target, float importance, bool* errorMask,
+                      int batchSample = -1);
+      // the batch is prepared by the base classifier which owns the weak classifiers
+      void
+      prepareBatch(ImageRepresentation* image, const std::vector<Rect> & ROIs);
+      void
+      clearBatch();
 
       void
       getErrorMask(ImageRepresentation* image, Rect ROI, int target, bool* errorMask);
@@ -491,20 +722,37 @@ namespace cv
       void
       replaceClassifierStatistic(int sourceIndex, int targetIndex);
 
+      // selection and error weights, and the weak classifiers if they are not shared
+      void
+      write(std::ostream & os) const;
+      bool
+      read(std::istream & is);
+
       int
       eval(ImageRepresentation* image, Rect ROI);
+      int
+      eval(const ImageRepresentation* image, Rect ROI, float variance, EvalScratch & scratch) const;
+      // the batch has to be prepared by the base classifier which owns the weak classifiers
+      int
+      evalBatchSample(int batchSample);
+      void
+      evalGrid(const ImageRepresentation* image, Rect firstPatch, Size step, float alpha,
+               const cv::Mat_<float>* variances, cv::Mat_<float> & confidences, EvalScratch & scratch) const;
 
       float
       getValue(ImageRepresentation *image, Rect ROI, int weakClassifierIdx = -1);
 
-      WeakClassifier**
+      void
+      prepareScales(const std::vector<Size> & patchSizes, int integralStep);
+
+      WeakClassifierPool*
       getReferenceWeakClassifier()
       {
         return weakClassifier;
       }
       ;
       void
-      setReferenceWeakClassifier(WeakClassifier** weakClassifier)
+      setReferenceWeakClassifier(WeakClassifierPool* weakClassifier)
       {
         this->weakClassifier = weakClassifier;
       }
@@ -549,10 +797,11 @@ namespace cv
       }
       ;
 
+      // all weak classifiers are Haar feature classifiers
       int
       getTypeOfSelectedClassifier()
       {
-        return weakClassifier[m_selectedClassifier]->getType();
+        return 1;
       }
       ;
       int
@@ -570,7 +819,7 @@ namespace cv
 
     protected:
 
-      WeakClassifier** weakClassifier;
+      WeakClassifierPool* weakClassifier;
       bool m_referenceWeakClassifier;
       int m_numWeakClassifier;
       int m_selectedClassifier;
@@ -578,11 +827,25 @@ namespace cv
       std::vector<float> m_wCorrect;
       std::vector<float> m_wWrong;
       int m_iterationInit;
-      void
-      generateRandomClassifier(Size patchSize);
 
     };
 
+    // sample of a batch update
+    struct TrainingSample
+    {
+      TrainingSample(Rect ROI, int target, float importance = 1.0f)
+          :
+            ROI(ROI),
+            target(target),
+            importance(importance)
+      {
+      }
+
+      Rect ROI;
+      int target;
+      float importance;
+    };
+
     class StrongClassifier
     {
     public:
@@ -596,10 +859,59 @@ namespace cv
       virtual float
       eval(ImageRepresentation *image, Rect ROI);
 
+      // thread-safe evaluation, every thread needs its own scratch
+      virtual float
+      eval(const ImageRepresentation *image, Rect ROI, EvalScratch & scratch) const;
+      // confidences of a regular grid of patches at once, confidences and variances (if the image uses variance
+      // normalization) have to have the size of the grid
+      virtual void
+      evalGrid(const ImageRepresentation *image, Rect firstPatch, Size step, const cv::Mat_<float>* variances,
+               cv::Mat_<float> & confidences, EvalScratch & scratch) const;
+      // scales the features of the selected weak classifiers to the patch sizes of a scan in advance, which has
+      // to be done before evaluating them from several threads
+      void
+      prepareScales(const std::vector<Size> & patchSizes, int integralStep = -1);
+
+      // soft cascade: the base classifiers are evaluated by descending alpha, and prepareCascade has to be called
+      // after the classifier has been updated
+      void
+      prepareCascade();
+      // stops as soon as the patch can not get above minMargin anymore, falls below the rejection thresholds, or
+      // is a detection which can not beat maxConfidence; the result is then a bound that keeps these decisions
+      float
+      evalCascade(const ImageRepresentation *image, Rect ROI, float minMargin, float maxConfidence,
+                  EvalScratch & scratch) const;
+      // adds the votes of the base classifier of the given stage for a regular grid of patches
+      void
+      evalGridStage(const ImageRepresentation *image, int stage, Rect firstPatch, Size step,
+                    const cv::Mat_<float>* variances, cv::Mat_<float> & confidences, EvalScratch & scratch) const;
+      // sum of the alphas of the stages from stage on
+      float
+      getCascadeRemaining(int stage)
+      {
+        return m_cascadeRemaining[stage];
+      }
+      ;
+      // patches below minMargin plus this after the given stage are rejected
+      float
+      getRejectionThreshold(int stage)
+      {
+        return m_rejectionThresholds[stage];
+      }
+      ;
+      // the rejection thresholds are learned from the positive updates if enabled, otherwise only patches which
+      // can not get above minMargin anymore are rejected
+      void
+      setUseRejectionThresholds(bool useRejectionThresholds);
+
       virtual bool
       update(ImageRepresentation *image, Rect ROI, int target, float importance = 1.0f);
       virtual bool
       updateSemi(ImageRepresentation *image, Rect ROI, float priorConfidence);
+      // learns the samples one after the other just like update, but the feature values of all of them are
+      // computed in one pass over the weak classifiers beforehand
+      void
+      updateBatch(ImageRepresentation *image, const std::vector<TrainingSample> & samples);
 
       cv::Size
       getPatchSize()
@@ -613,6 +925,12 @@ namespace cv
         return numBaseClassifier;
       }
       ;
+      BaseClassifier*
+      getBaseClassifier(int baseClassifierIdx)
+      {
+        return baseClassifier[baseClassifierIdx];
+      }
+      ;
       int
       getIdxOfSelectedClassifierOfBaseClassifier(int baseClassifierIdx = 0)
       {
@@ -633,7 +951,7 @@ namespace cv
       float
       getImportance(ImageRepresentation *image, Rect ROI, int traget, int numBaseClassifiers = -1);
 
-      WeakClassifier**
+      WeakClassifierPool*
       getReferenceWeakClassifier()
       {
         return baseClassifier[0]->getReferenceWeakClassifier();
@@ -643,6 +961,12 @@ namespace cv
       void
       resetWeightDistribution();
 
+      // learned state of a classifier, read only accepts the state of a classifier constructed alike
+      void
+      write(std::ostream & os) const;
+      bool
+      read(std::istream & is);
+
     protected:
 
       int numBaseClassifier;
@@ -654,14 +978,29 @@ namespace cv
 
       bool useFeatureExchange;
 
+      // update with the feature values of sample batchSample of the prepared batch
+      virtual bool
+      updateSample(ImageRepresentation *image, Rect ROI, int target, float importance, int batchSample);
+
+      void
+      addPositiveVotes(ImageRepresentation *image, Rect ROI, int batchSample = -1);
+
+      std::vector<int> m_cascadeOrder; // base classifiers by descending alpha
+      std::vector<float> m_cascadeRemaining; // sum of the alphas from every stage on
+      std::vector<float> m_rejectionThresholds;
+      bool m_useRejectionThresholds;
+      std::vector<std::vector<int> > m_positiveVotes; // votes for the last positive samples
+      int m_nextPositiveVotes;
+
     };
 
     class StrongClassifierDirectSelection: public StrongClassifier
     {
     public:
 
-      StrongClassifierDirectSelection(int numBaseClassifier, int numWeakClassifier, Size patchSize,
-                                      bool useFeatureExchange = false, int iterationInit = 0);
+      StrongClassifierDirectSelection(int numBaseClassifier, int numWeakClassifier, Size patchSize, cv::RNG & rng,
+                                      bool useFeatureExchange = false, int iterationInit = 0,
+                                      bool randomFeatures = true);
 
       virtual
       ~StrongClassifierDirectSelection();
@@ -669,6 +1008,11 @@ namespace cv
       bool
       update(ImageRepresentation *image, Rect ROI, int target, float importance = 1.0);
 
+    protected:
+
+      bool
+      updateSample(ImageRepresentation *image, Rect ROI, int target, float importance, int batchSample);
+
     private:
 
       bool * m_errorMask;
@@ -680,9 +1024,8 @@ namespace cv
     {
     public:
 
-      StrongClassifierStandard(int numBaseClassifier, int numWeakClassifier, Size patchSize, bool useFeatureExchange =
-          false,
-                               int iterationInit = 0);
+      StrongClassifierStandard(int numBaseClassifier, int numWeakClassifier, Size patchSize, cv::RNG & rng,
+                               bool useFeatureExchange = false, int iterationInit = 0, bool randomFeatures = true);
 
       virtual
       ~StrongClassifierStandard();
@@ -690,6 +1033,11 @@ namespace cv
       bool
       update(ImageRepresentation *image, Rect ROI, int target, float importance = 1.0);
 
+    protected:
+
+      bool
+      updateSample(ImageRepresentation *image, Rect ROI, int target, float importance, int batchSample);
+
     private:
 
       bool *m_errorMask;
@@ -700,26 +1048,75 @@ namespace cv
     {
     public:
 
-      StrongClassifierStandardSemi(int numBaseClassifier, int numWeakClassifier, Size patchSize,
-                                   bool useFeatureExchange = false, int iterationInit = 0);
+      StrongClassifierStandardSemi(int numBaseClassifier, int numWeakClassifier, Size patchSize, cv::RNG & rng,
+                                   bool useFeatureExchange = false, int iterationInit = 0,
+                                   bool randomFeatures = true);
 
       virtual
       ~StrongClassifierStandardSemi();
 
       bool
       updateSemi(ImageRepresentation *image, Rect ROI, float priorConfidence);
+      // learns the samples one after the other just like updateSemi, but the feature values of all of them are
+      // computed in one pass beforehand; the image is only read, so several classifiers can learn from it at once
+      void
+      updateSemiBatch(ImageRepresentation *image, const std::vector<Rect> & ROIs,
+                      const std::vector<float> & priorConfidences);
+      // the pass of updateSemiBatch over the feature values alone, in parallel across the base classifiers; it can
+      // be done ahead of updateSemiBatch with the same ROIs, which then only learns the samples
+      void
+      prepareSemiBatch(ImageRepresentation *image, const std::vector<Rect> & ROIs);
       void
       getPseudoValues(ImageRepresentation *image, Rect ROI, float priorConfidence, float* pseudoLambdaInOut,
                       int* pseudoTargetInOut);
 
     private:
 
+      bool
+      updateSemiSample(ImageRepresentation *image, Rect ROI, float priorConfidence, int batchSample);
+
       bool *m_errorMask;
       std::vector<float> m_errors;
+      bool m_batchPrepared; // prepareSemiBatch has been called for the next updateSemiBatch
       std::vector<float> m_pseudoLambda;
       std::vector<int> m_pseudoTarget;
     };
 
+    // Immutable copy of a trained strong classifier which is not updated anymore, like the prior of the
+    // semi-supervised tracker. Only the selected features of the base classifiers with a weight are kept, along
+    // with their thresholds and alphas, so evaluating a patch is a single loop over them.
+    class FrozenClassifier
+    {
+    public:
+
+      FrozenClassifier(StrongClassifier* classifier);
+
+      // same result as StrongClassifier::eval of the frozen classifier
+      float
+      eval(ImageRepresentation* image, Rect ROI);
+      float
+      getSumAlpha() const
+      {
+        return m_sumAlpha;
+      }
+      ;
+
+      void
+      write(std::ostream & os) const;
+      static FrozenClassifier*
+      read(std::istream & is);
+
+    private:
+
+      FrozenClassifier();
+
+      std::vector<FeatureHaar> m_features;
+      std::vector<float> m_thresholds;
+      std::vector<float> m_parities;
+      std::vector<float> m_alphas;
+      float m_sumAlpha; // of all base classifiers, in their order
+    };
+
     class Detector
     {
     public:
@@ -736,6 +1133,51 @@ namespace cv
       void
       classifySmooth(ImageRepresentation* image, Patches* patches, float minMargin = 0);
 
+      // number of threads the patches are split up between. 0, the default, takes as many as OpenMP gives a
+      // parallel region of the calling thread, which is all available cores unless the caller limits them.
+      void
+      setNumThreads(int numThreads);
+
+      // soft cascade early termination, off by default. Only the detection count and the best detection are exact
+      // then: the confidence of any other detection is a lower bound above the margin, the one of any other patch an
+      // upper bound at most the margin. With the rejection thresholds of the classifier not even these are exact, a
+      // patch whose partial sum falls below the one of every recent positive sample is rejected, though it may have
+      // ended up a detection or the best one.
+      void
+      setEarlyTermination(bool earlyTermination)
+      {
+        m_earlyTermination = earlyTermination;
+      }
+      ;
+      bool
+      getEarlyTermination()
+      {
+        return m_earlyTermination;
+      }
+      ;
+      int
+      getNumThreads();
+
+      // coarse to fine search in classifySmooth, off for coarse steps below two. The grid is evaluated at every
+      // coarseStep-th patch in both directions first, then at every patch only around the numCandidates best of
+      // them. It takes the place of the soft cascade when both are set.
+      void
+      setCoarseToFine(int coarseStep, int numCandidates);
+      int
+      getCoarseStep() const
+      {
+        return m_coarseStep;
+      }
+      ;
+
+      // number of patches the classifier was evaluated on in the last classification
+      int
+      getNumEvaluations() const
+      {
+        return m_numEvaluations;
+      }
+      ;
+
       int
       getNumDetections();
       float
@@ -780,8 +1222,16 @@ namespace cv
       prepareConfidencesMemory(int numPatches);
       void
       prepareDetectionsMemory(int numDetections);
+      void
+      evalGridCascade(const ImageRepresentation* image, Rect firstPatch, Size step, const cv::Mat_<float>* variances,
+                      float minMargin);
+      void
+      evalGridCoarseToFine(const ImageRepresentation* image, Rect firstPatch, Size step,
+                           const cv::Mat_<float>* variances, float minMargin);
 
       StrongClassifier* m_classifier;
+      std::vector<Size> m_patchSizes; // distinct patch sizes of the last scan
+      int m_numThreads; // 0 for the OpenMP default
       std::vector<float> m_confidences;
       int m_sizeConfidences;
       int m_numDetections;
@@ -792,13 +1242,64 @@ namespace cv
       cv::Mat_<float> m_confMatrix;
       cv::Mat_<float> m_confMatrixSmooth;
       cv::Mat_<unsigned char> m_confImageDisplay;
+
+      bool m_earlyTermination;
+      cv::Mat_<unsigned char> m_undecided; // patches of the grid whose smoothed confidence is still needed
+      cv::Mat_<unsigned char> m_needed; // patches of the grid whose raw confidence is still needed
+      cv::Mat_<float> m_decidedConfidences;
+
+      int m_coarseStep;
+      int m_numCandidates;
+      int m_numEvaluations;
+      cv::Mat_<float> m_coarseConfidences;
+      cv::Mat_<float> m_coarseVariances;
+      std::vector<std::pair<float, int> > m_coarseOrder; // negated coarse confidences and their coarse patch
+    };
+
+    /** Constant velocity Kalman filter of the center of the tracked patch, the axes are filtered independently. It
+     *  holds the prediction for the next frame between the frames. */
+    class MotionModel
+    {
+    public:
+
+      MotionModel();
+
+      void
+      init(Point2f center);
+      // the measured center is trusted the less the lower its confidence in [0, 1] is
+      void
+      correct(Point2f center, float confidence);
+      void
+      predict();
+
+      // window around the predicted center which covers the uncertainty of the prediction, at most maxFactor times
+      // the patch size and inside validROI
+      Rect
+      getSearchRegion(Size patchSize, float maxFactor, Rect validROI) const;
+      Point2f
+      getPrediction() const
+      {
+        return Point2f(m_position[0], m_position[1]);
+      }
+      ;
+
+    private:
+
+      float m_position[2];
+      float m_velocity[2];
+      float m_varPosition[2];
+      float m_covariance[2]; // of position and velocity
+      float m_varVelocity[2];
     };
 
     /** The main Online Boosting tracker class */
     class BoostingTracker
     {
     public:
-      BoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI, int numBaseClassifier);
+      // all random decisions of the tracker are drawn from its own generator, so runs with the same seed give the
+      // same results, independent of other trackers
+      BoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI, int numBaseClassifier,
+                      uint64 seed = 0xffffffff);
       virtual
       ~BoostingTracker();
 
@@ -818,20 +1319,63 @@ namespace cv
       {
         return detector->getConfImageDisplay();
       }
+      void
+      setEarlyTermination(bool earlyTermination, bool useRejectionThresholds = false);
+      void
+      setCoarseToFine(int coarseStep, int numCandidates);
+      int
+      getNumEvaluations() const
+      {
+        return detector->getNumEvaluations();
+      }
+
+      // The search region follows the motion predicted from the last frames, and is as large as its uncertainty
+      // instead of searchFactor times the patch. Off by default, getTrackingROI has to be called before every
+      // track with it.
+      void
+      setMotionModel(bool useMotionModel);
+      // region of the image the next track reads, which the image representation has to cover: the tracking ROI
+      // and, with the motion model, the fixed search region the negatives of the update come from
+      Rect
+      getImageROI() const
+      {
+        return imageROI;
+      }
+
+      // Snapshot of the trained tracker, in a versioned binary format of fixed size fields. A tracker read from it
+      // resumes where the written one stopped without the initial training, read returns NULL if the snapshot
+      // is not valid or its sizes exceed the snapshot limits. The early termination, coarse to fine and motion model settings are not part of the
+      // snapshot.
+      void
+      write(std::ostream & os) const;
+      static BoostingTracker*
+      read(std::istream & is);
 
     private:
+      BoostingTracker();
+      void
+      createClassifier(int numBaseClassifier, Size patchSize, bool randomFeatures);
+      Rect
+      getNegative(Patches* patches, Patches::SpecialRect corner);
+
       StrongClassifier* classifier;
       Detector* detector;
       Rect validROI;
       Rect trackedPatch;
       float confidence;
       cv::Point2i dxDy;
+      cv::RNG rng;
+      bool useMotionModel;
+      MotionModel motion;
+      Rect trainingROI; // fixed search region the negatives are taken from with the motion model
+      Rect imageROI;
     };
 
     class SemiBoostingTracker
     {
     public:
-      SemiBoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI, int numBaseClassifier);
+      SemiBoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI, int numBaseClassifier,
+                          uint64 seed = 0xffffffff);
 
       bool
       track(ImageRepresentation* image, Patches* patches);
@@ -851,15 +1395,49 @@ namespace cv
       {
         return detector->getConfImageDisplay();
       }
+      void
+      setEarlyTermination(bool earlyTermination, bool useRejectionThresholds = false);
+      void
+      setCoarseToFine(int coarseStep, int numCandidates);
+      int
+      getNumEvaluations() const
+      {
+        return detector->getNumEvaluations();
+      }
+      // see BoostingTracker::setMotionModel
+      void
+      setMotionModel(bool useMotionModel);
+      Rect
+      getImageROI() const
+      {
+        return imageROI;
+      }
+
+      // see BoostingTracker::write
+      void
+      write(std::ostream & os) const;
+      static SemiBoostingTracker*
+      read(std::istream & is);
 
     private:
-      cv::Ptr<StrongClassifier> classifierOff;
+      SemiBoostingTracker();
+      StrongClassifierStandardSemi*
+      createClassifier(int numBaseClassifier, Size patchSize, cv::RNG & rng, bool randomFeatures);
+      Rect
+      getNegative(Patches* patches, Patches::SpecialRect corner);
+
+      cv::Ptr<FrozenClassifier> prior; // the offline classifier, trained on the first frame only
       cv::Ptr<StrongClassifierStandardSemi> classifier;
       cv::Ptr<Detector> detector;
       Rect trackedPatch;
       Rect validROI;
       float confidence;
       float priorConfidence;
+      cv::RNG rng;
+      bool useMotionModel;
+      MotionModel motion;
+      Rect trainingROI;
+      Rect imageROI;
     };
 
   }
@@ -44,6 +44,7 @@
 #define __OPENCV_OBJECT_TRACKER_H__
 
 #include <opencv2/core/core.hpp>
+#include <iosfwd>
 
 #include "cv_onlineboosting.h"
 #include "cv_onlinemil.h"
@@ -74,6 +75,12 @@ namespace cv
     int num_classifiers_; // the number of classifiers to use in a given boosting algorithm (OnlineBoosting, MIL)
     float overlap_; // search region parameters to use in a given boosting algorithm (OnlineBoosting, MIL)
     float search_factor_; // search region parameters to use in a given boosting algorithm (OnlineBoosting, MIL)
+    bool early_termination_; // soft cascade detection in the boosting algorithms (OnlineBoosting, SemiOnlineBoosting)
+    bool rejection_thresholds_; // soft cascade rejection thresholds learned from the positive updates
+    int coarse_step_; // coarse to fine search with this step in patches, the whole search region is scanned below 2
+    int coarse_candidates_; // best coarse patches around which the coarse to fine search scans every patch
+    bool motion_model_; // search region from a constant velocity model, at most search_factor_ times the patch
+    uint64 seed_; // seed of the random number generator of a boosting tracker (OnlineBoosting, SemiOnlineBoosting)
 
     // The following are specific to the MIL algorithm
     float pos_radius_train_; // radius for gathering positive instances
@@ -100,14 +107,68 @@ namespace cv
     virtual bool
     update(const cv::Mat & image, const ObjectTrackerParams& params, cv::Rect & track_box) = 0;
 
+    // Update with a frame that differs from the one of the previous update only within changed_rect.  By
+    // default the frame is tracked as with update().
+    virtual bool
+    update_changed(const cv::Mat & image, const cv::Rect & changed_rect, const ObjectTrackerParams& params,
+                   cv::Rect & track_box);
+
+    // Write the trained state of the tracker, or restore it in place of an initialization.  Algorithms
+    // which don't support this return false.
+    virtual bool
+    save(std::ostream & os) const;
+
+    virtual bool
+    load(std::istream & is, const ObjectTrackerParams& params);
+
+    // The region of the next frame that update reads, only this part of a color frame is converted.
+    // The whole frame by default.
+    virtual cv::Rect
+    import_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
+    // Pipelined updates, see ObjectTracker::submit.  prepare_region() is the region of the frame after the
+    // next one that update could read, wherever the tracker finds the target in the next frame; the whole
+    // frame by default.  prepare() gets a frame ready for track_prepared() in one of two slots, as far as
+    // that does not depend on the frames before it.  It runs in parallel to track_prepared() of the other
+    // slot, so it must not touch the tracker state.  'region' is the prepare_region() of the frame.  By
+    // default the frame is only copied for update(), as the caller may reuse its buffer before then.
+    virtual cv::Rect
+    prepare_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
+    virtual void
+    prepare(const cv::Mat & image, const cv::Rect & region, int slot);
+
+    virtual bool
+    track_prepared(int slot, const ObjectTrackerParams& params, cv::Rect & track_box);
+
+    // Whether the algorithm prints the confidence of every frame to the console, on by default.  Targets
+    // tracked at once in parallel turn it off, their lines would interleave.
+    void
+    set_print_confidence(bool print_confidence);
+
   protected:
     // A method to import an image to the type desired for the current algorithm
     virtual void
     import_image(const cv::Mat & image) = 0;
 
+    // Set image_ to the 8-bit gray-scale version of image.  A gray-scale image is shared, not copied, and a
+    // color image is converted within roi only, image_ is undefined outside of it then.  A 2-channel image
+    // is packed YUYV, its luma is the first channel.
+    void
+    import_gray_image(const cv::Mat & image, const cv::Rect & roi);
+
     // A local image holder (can be gray-scale, color, depth image 16-bit, whatever
     // you want...)
     cv::Mat image_;
+
+    // Gray-scale conversion of color input, which image_ refers to then
+    cv::Mat gray_image_;
+
+    // Copies of the frames of the pipeline slots, for algorithms which read the whole frame in update()
+    cv::Mat prepared_images_[2];
+
+    // See set_print_confidence
+    bool print_confidence_;
   };
 
   //
@@ -132,18 +193,58 @@ namespace cv
     virtual bool
     update(const cv::Mat & image, const ObjectTrackerParams& params, cv::Rect & track_box);
 
+    virtual bool
+    update_changed(const cv::Mat & image, const cv::Rect & changed_rect, const ObjectTrackerParams& params,
+                   cv::Rect & track_box);
+
+    virtual bool
+    save(std::ostream & os) const;
+
+    virtual bool
+    load(std::istream & is, const ObjectTrackerParams& params);
+
+    virtual cv::Rect
+    import_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
+    virtual cv::Rect
+    prepare_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
+    virtual void
+    prepare(const cv::Mat & image, const cv::Rect & region, int slot);
+
+    virtual bool
+    track_prepared(int slot, const ObjectTrackerParams& params, cv::Rect & track_box);
+
   protected:
     // A method to import an image to the type desired for the current algorithm
     virtual void
     import_image(const cv::Mat & image);
 
   private:
+    // Track in a frame whose representation covers 'covered' already, the rest of the region the
+    // tracker reads is imported and integrated first.  A prepared frame is only passed as its size, its
+    // representation has to cover all the tracker reads.
+    bool
+    track_frame(const cv::Mat & image, const cv::Size & image_size, boosting::ImageRepresentation* frame_rep,
+                const cv::Rect & covered, const ObjectTrackerParams& params, cv::Rect & track_box);
+
+    // Free the frame representations of the pipeline slots
+    void
+    release_prepared();
+
     // The main boosting tracker object
     boosting::BoostingTracker* tracker_;
 
     // The main image frame representation, useful for the boosting tracker
     boosting::ImageRepresentation* cur_frame_rep_;
 
+    // The frame representations of the pipeline slots, the regions they cover, the sizes of their frames
+    // and the gray-scale conversions of color frames.  The frames themselves are not kept.
+    boosting::ImageRepresentation* prepared_reps_[2];
+    cv::Rect prepared_regions_[2];
+    cv::Size prepared_sizes_[2];
+    cv::Mat prepared_gray_images_[2];
+
     // The overall tracking rectangle region-of-interesting
     cv::Size tracking_rect_size_;
 
@@ -174,18 +275,58 @@ namespace cv
     virtual bool
     update(const cv::Mat & image, const ObjectTrackerParams& params, cv::Rect & track_box);
 
+    virtual bool
+    update_changed(const cv::Mat & image, const cv::Rect & changed_rect, const ObjectTrackerParams& params,
+                   cv::Rect & track_box);
+
+    virtual bool
+    save(std::ostream & os) const;
+
+    virtual bool
+    load(std::istream & is, const ObjectTrackerParams& params);
+
+    virtual cv::Rect
+    import_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
+    virtual cv::Rect
+    prepare_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
+    virtual void
+    prepare(const cv::Mat & image, const cv::Rect & region, int slot);
+
+    virtual bool
+    track_prepared(int slot, const ObjectTrackerParams& params, cv::Rect & track_box);
+
   protected:
     // A method to import an image to the type desired for the current algorithm
     virtual void
     import_image(const cv::Mat & image);
 
   private:
+    // Track in a frame whose representation covers 'covered' already, the rest of the region the
+    // tracker reads is imported and integrated first.  A prepared frame is only passed as its size, its
+    // representation has to cover all the tracker reads.
+    bool
+    track_frame(const cv::Mat & image, const cv::Size & image_size, boosting::ImageRepresentation* frame_rep,
+                const cv::Rect & covered, const ObjectTrackerParams& params, cv::Rect & track_box);
+
+    // Free the frame representations of the pipeline slots
+    void
+    release_prepared();
+
     // The main boosting tracker object
     boosting::SemiBoostingTracker* tracker_;
 
     // The main image frame representation, useful for the boosting tracker
     boosting::ImageRepresentation* cur_frame_rep_;
 
+    // The frame representations of the pipeline slots, the regions they cover, the sizes of their frames
+    // and the gray-scale conversions of color frames.  The frames themselves are not kept.
+    boosting::ImageRepresentation* prepared_reps_[2];
+    cv::Rect prepared_regions_[2];
+    cv::Size prepared_sizes_[2];
+    cv::Mat prepared_gray_images_[2];
+
     // The overall tracking rectangle region-of-interesting
     cv::Size tracking_rect_size_;
 
@@ -215,6 +356,9 @@ namespace cv
     virtual bool
     update(const cv::Mat & image, const ObjectTrackerParams& params, cv::Rect & track_box);
 
+    virtual cv::Rect
+    import_region(const cv::Size & image_size, const ObjectTrackerParams& params);
+
   protected:
     // A method to import an image to the type desired for the current algorithm
     virtual void
@@ -264,6 +408,18 @@ namespace cv
   //
   //
 
+  // The result of a frame tracked in the pipeline of ObjectTracker::submit
+  CV_EXPORTS struct ObjectTrackerResult
+  {
+    int frame_; // the index of the frame among the submitted ones, from 0
+    cv::Rect track_box_; // the new tracking bounding box
+    bool found_; // whether the tracker succeeded, as update() returns it
+  };
+
+  //
+  //
+  //
+
   // The main Object Tracking class, which implements different object tracking
   // algorithms.  See the specific class instances above.  This is the class
   // that the user will use.  We use an inheritance hierarchy to determine which
@@ -273,6 +429,12 @@ namespace cv
   CV_EXPORTS class ObjectTracker
   {
   public:
+    // Pixel formats of raw 8-bit frames
+    enum
+    {
+      PIXEL_FORMAT_GRAY, PIXEL_FORMAT_NV12, PIXEL_FORMAT_NV21, PIXEL_FORMAT_I420, PIXEL_FORMAT_YV12, PIXEL_FORMAT_YUYV
+    };
+
     // Default constructor--performs initializations of the class and memory.
     // Input the tracking parameters (which are defaulted if you don't give
     // any).
@@ -296,6 +458,10 @@ namespace cv
     //    depth images we'll probably also allow IPL_DEPTH_16S.
     // -- Be sure to do boundary checks on 'boundingBox' to account for user error.
     //
+    // The image is 8-bit gray-scale, RGB or RGBA.  A 2-channel image is taken as packed YUYV, as the raw
+    // frames below, of which the first channel is the luma.  The same goes for the images of update()
+    // and submit().
+    //
     virtual bool
     initialize(const cv::Mat & image, const CvRect& bounding_box);
 
@@ -318,11 +484,66 @@ namespace cv
     virtual bool
     update(const cv::Mat & image, cv::Rect & track_box);
 
+    // Update the tracker with a frame of a static camera that differs from the previous frame only within
+    // changed_rect, as found by frame differencing for example, and empty if nothing changed.  The boosting
+    // algorithms then update their integral images only where the frame changed.  The previous frame has
+    // to be the one given to initialize() or update().
+    //
+    bool
+    update(const cv::Mat & image, const cv::Rect & changed_rect, cv::Rect & track_box);
+
+    // Initialize or update the tracker with a raw frame of one of the pixel formats above, as it comes
+    // from a camera.  The trackers only use the luma.  The Y plane of the planar and semi-planar formats
+    // is read in place without a conversion, like a gray-scale frame.  The Y samples of YUYV are copied
+    // out of every other byte into a gray-scale buffer, within the region the tracker reads only.
+    // 'step' is the number of bytes per row of the Y plane, or of the packed YUYV frame.
+    //
+    bool
+    initialize(const unsigned char* data, size_t step, int width, int height, int format,
+               const CvRect& bounding_box);
+
+    bool
+    update(const unsigned char* data, size_t step, int width, int height, int format, cv::Rect & track_box);
+
+    // Pipelined updates for multicore machines.  submit() hands in the next frame and returns the result
+    // of the frame submitted before it: the new frame is imported and its integral images are built while
+    // the previous frame is tracked, in parallel with OpenMP.  The tracker gets as many threads as in
+    // update(), in a nested parallel region, and one thread prepares the new frame on top of them.  The
+    // caller has to allow the nesting, e.g. with omp_set_max_active_levels(2) or OMP_MAX_ACTIVE_LEVELS=2;
+    // submit() does not change this process-wide setting, and without it the new frame is prepared before
+    // the previous one is tracked.  The results come one frame late, in order, and are the same as those
+    // of update().  flush() returns the result of the last submitted frame, it has to be called before
+    // update() is used again.  The frames are copied, so the buffer of a submitted frame can take the next
+    // one right away; the boosting algorithms keep only the integral images of the part they can read.
+    // Return false if there is no result yet.
+    //
+    bool
+    submit(const cv::Mat & image, ObjectTrackerResult & result);
+
+    bool
+    flush(ObjectTrackerResult & result);
+
+    // Save the trained tracker to a file after initialization, or load such a file in place of
+    // initialize(), so a re-acquired target resumes without training the tracker again.  The file
+    // has to be loaded with the same algorithm it was saved with.  Only the boosting algorithms
+    // support this, return true on success.
+    //
+    bool
+    save(const std::string & filename) const;
+
+    bool
+    load(const std::string & filename);
+
     // Store the input parameters internally
     void
     set_params(const ObjectTrackerParams& params);
 
   private:
+    // A header to the luma of a raw frame, without a copy of the data.  YUYV gives a 2-channel image
+    // with the luma in the first channel.  An empty one is returned for invalid frames.
+    static cv::Mat
+    luma_image(const unsigned char* data, size_t step, int width, int height, int format);
+
     // A flag indicating whether or not this tracker has been initialized yet.
     // It's important to keep track of so the user doesn't try to track
     // without initializing first!
@@ -333,6 +554,58 @@ namespace cv
 
     // The actual tracking algorithm
     TrackingAlgorithm* tracker_;
+
+    // The number of frames submitted to the pipeline, and how many of them are tracked
+    int num_submitted_;
+    int num_tracked_;
+  };
+
+  //
+  //
+  //
+
+  // Tracks several objects in the same stream with the same parameters.  Every frame is imported
+  // once for all of them, a color frame is converted to gray-scale within the union of the regions
+  // the targets read.  The boosting targets are then updated in parallel, and do not print their
+  // confidences.
+  //
+  CV_EXPORTS class MultiObjectTracker
+  {
+  public:
+    MultiObjectTracker(const ObjectTrackerParams& params = ObjectTrackerParams());
+
+    virtual
+    ~MultiObjectTracker();
+
+    // Start tracking an object from the given frame, return its index or -1 if the tracker could
+    // not be initialized.  The indices of the targets follow the order they were added in.
+    int
+    add_target(const cv::Mat & image, const CvRect& bounding_box);
+
+    // Stop tracking a target, the targets added after it move down one index.
+    void
+    remove_target(int index);
+
+    int
+    get_num_targets() const
+    {
+      return (int) targets_.size();
+    }
+
+    // Update all targets with the next frame.  'track_boxes' and 'found' get the box of every target
+    // and whether it was found, by index.  Return the number of targets found.
+    int
+    update(const cv::Mat & image, std::vector<cv::Rect> & track_boxes, std::vector<bool> & found);
+
+  private:
+    // The parameters of all targets
+    ObjectTrackerParams tracker_params_;
+
+    // One tracking algorithm per target
+    std::vector<TrackingAlgorithm*> targets_;
+
+    // Gray-scale conversion of color frames, shared by the targets
+    cv::Mat gray_image_;
   };
 
 }
@@ -44,9 +44,38 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BOOSTING_INTEGRAL_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BOOSTING_INTEGRAL_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BOOSTING_INTEGRAL_NEON 1
+#endif
+
 #include "cv_onlineboosting.h"
 
 #define sign(x) (((x)>=0)? 1.0f : -1.0f)
+#define MAX_RESPONSE_ROIS 16
+#define RESPONSE_SLOT_INIT_SIZE 1024
+#define SNAPSHOT_MAGIC 0x5453424f // "OBST"
+#define SNAPSHOT_VERSION 2
+#define MAX_SNAPSHOT_AREAS 16
+#define MAX_SNAPSHOT_BASE_CLASSIFIERS 1000 // also bounds the features of a frozen classifier
+#define MAX_SNAPSHOT_PATCH_SIZE 8192
+#define MOTION_NOISE_POSITION 4.0f // process noise of the motion model, in pixels^2 per frame
+#define MOTION_NOISE_VELOCITY 2.0f
+#define MOTION_NOISE_MEASUREMENT 4.0f // of a measured center of confidence 1
+#define MOTION_MIN_CONFIDENCE 0.05f
+#define MOTION_INIT_VAR_VELOCITY 25.0f
+#define MOTION_SIGMAS 3.0f // standard deviations of the prediction covered by the search region
+#define MOTION_MIN_MARGIN 4 // pixels around the patch searched at least
 
 /****************************************************************************************
  COPYRIGHT NOTICE
@@ -62,6 +91,71 @@ namespace cv
 {
   namespace boosting
   {
+    // Snapshots consist of 32 bit values in the native byte order only, besides the 64 bit generator states. The
+    // records of the features vary in length, so a snapshot is parsed from the start.
+    template<typename T>
+    static void
+    writeValues(std::ostream & os, const T* values, int count)
+    {
+      if (count > 0)
+        os.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+    }
+
+    template<typename T>
+    static bool
+    readValues(std::istream & is, T* values, int count)
+    {
+      if (count > 0)
+        is.read(reinterpret_cast<char*>(values), count * sizeof(T));
+      return !is.fail();
+    }
+
+    static void
+    writeInt(std::ostream & os, int value)
+    {
+      writeValues(os, &value, 1);
+    }
+
+    static bool
+    readInt(std::istream & is, int & value)
+    {
+      return readValues(is, &value, 1);
+    }
+
+    static void
+    writeRect(std::ostream & os, Rect rect)
+    {
+      int values[4] = { rect.x, rect.y, rect.width, rect.height };
+      writeValues(os, values, 4);
+    }
+
+    static bool
+    readRect(std::istream & is, Rect & rect)
+    {
+      int values[4];
+      if (!readValues(is, values, 4))
+        return false;
+      rect = Rect(values[0], values[1], values[2], values[3]);
+      return true;
+    }
+
+    // the number of elements is checked against the one of the vector, which is sized by the constructors
+    static void
+    writeFloats(std::ostream & os, const std::vector<float> & values)
+    {
+      writeInt(os, static_cast<int>(values.size()));
+      writeValues(os, values.empty() ? NULL : &values[0], static_cast<int>(values.size()));
+    }
+
+    static bool
+    readFloats(std::istream & is, std::vector<float> & values)
+    {
+      int size;
+      if (!readInt(is, size) || size != static_cast<int>(values.size()))
+        return false;
+      return readValues(is, values.empty() ? NULL : &values[0], size);
+    }
+
     cv::Rect
     RectMultiply(const cv::Rect & rect, float f)
     {
@@ -100,9 +194,166 @@ namespace cv
       return isDet;
     }
 
+#if defined(BOOSTING_INTEGRAL_AVX2)
+    // inclusive prefix sum over the eight 32-bit lanes of v
+    static inline __m256i
+    integralPrefix8(__m256i v)
+    {
+      v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+      v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+      // carry the total of the low 128-bit lane into the high one
+      __m256i lowTotal = _mm256_shuffle_epi32(v, 0xFF);
+      return _mm256_add_epi32(v, _mm256_permute2x128_si256(lowTotal, lowTotal, 0x08));
+    }
+#elif defined(BOOSTING_INTEGRAL_SSE2)
+    // inclusive prefix sum over the four 32-bit lanes of v
+    static inline __m128i
+    integralPrefix4(__m128i v)
+    {
+      v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+      return _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    }
+#elif defined(BOOSTING_INTEGRAL_NEON)
+    // inclusive prefix sum over the four 32-bit lanes of v
+    static inline uint32x4_t
+    integralPrefix4(uint32x4_t v)
+    {
+      const uint32x4_t zero = vdupq_n_u32(0);
+      v = vaddq_u32(v, vextq_u32(zero, v, 3));
+      return vaddq_u32(v, vextq_u32(zero, v, 2));
+    }
+
+    // integrates four pixels of a row, updating the running row sums
+    static inline void
+    integralBlock4(uint16x4_t pixels, const int* pSumPrev, int* pSum, const int64* pSqSumPrev, int64* pSqSum,
+                   uint32x4_t & rowSum, uint64x2_t & rowSqSum)
+    {
+      uint32x4_t sum = vaddq_u32(integralPrefix4(vmovl_u16(pixels)), rowSum);
+      rowSum = vdupq_n_u32(vgetq_lane_u32(sum, 3));
+      vst1q_s32(pSum, vaddq_s32(vreinterpretq_s32_u32(sum), vld1q_s32(pSumPrev)));
+
+      uint32x4_t sqSum = integralPrefix4(vmull_u16(pixels, pixels));
+      uint64x2_t sqSumLow = vaddq_u64(vmovl_u32(vget_low_u32(sqSum)), rowSqSum);
+      uint64x2_t sqSumHigh = vaddq_u64(vmovl_u32(vget_high_u32(sqSum)), rowSqSum);
+      rowSqSum = vdupq_n_u64(vgetq_lane_u64(sqSumHigh, 1));
+      vst1q_s64(pSqSum, vaddq_s64(vreinterpretq_s64_u64(sqSumLow), vld1q_s64(pSqSumPrev)));
+      vst1q_s64(pSqSum + 2, vaddq_s64(vreinterpretq_s64_u64(sqSumHigh), vld1q_s64(pSqSumPrev + 2)));
+    }
+#endif
+
+    // Computes the sum and the squared sum integral images of an 8-bit image in a single pass. Both tables have
+    // (height + 1) x (width + 1) entries, and their first row and column have to hold valid integral values
+    // already: zeros when integrating a whole image like cv::integral, or the unchanged part of the tables when
+    // only a sub-block is updated. Squared sums are accumulated as 64-bit integers, so they stay exact for any
+    // image size.
+    static void
+    integralSumSqSum(const uchar* src, size_t srcStep, int width, int height, int* sum, size_t sumStep, int64* sqSum,
+                     size_t sqSumStep)
+    {
+      for (int y = 0; y < height; y++)
+      {
+        const uchar* pSrc = src + y * srcStep;
+        const int* pSumPrev = sum + y * sumStep + 1;
+        int* pSum = sum + (y + 1) * sumStep + 1;
+        const int64* pSqSumPrev = sqSum + y * sqSumStep + 1;
+        int64* pSqSum = sqSum + (y + 1) * sqSumStep + 1;
+
+        // sums of the row left of the block
+        int x = 0;
+        int rowSum = pSum[-1] - pSumPrev[-1];
+        int64 rowSqSum = pSqSum[-1] - pSqSumPrev[-1];
+
+#if defined(BOOSTING_INTEGRAL_AVX2)
+        const __m256i lastLane = _mm256_set1_epi32(7);
+        __m256i vRowSum = _mm256_set1_epi32(rowSum);
+        __m256i vRowSqSum = _mm256_set1_epi64x(rowSqSum);
+        for (; x + 8 <= width; x += 8)
+        {
+          __m256i pixels = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (pSrc + x)));
+
+          __m256i vSum = _mm256_add_epi32(integralPrefix8(pixels), vRowSum);
+          vRowSum = _mm256_permutevar8x32_epi32(vSum, lastLane);
+          _mm256_storeu_si256((__m256i*) (pSum + x),
+                              _mm256_add_epi32(vSum, _mm256_loadu_si256((const __m256i*) (pSumPrev + x))));
+
+          // squares of 8-bit values and their prefix sums within the block fit into 32 bits
+          __m256i vSqSum = integralPrefix8(_mm256_mullo_epi32(pixels, pixels));
+          __m256i vSqSumLow = _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(vSqSum)), vRowSqSum);
+          __m256i vSqSumHigh = _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(vSqSum, 1)),
+                                                vRowSqSum);
+          vRowSqSum = _mm256_permute4x64_epi64(vSqSumHigh, 0xFF);
+          _mm256_storeu_si256((__m256i*) (pSqSum + x),
+                              _mm256_add_epi64(vSqSumLow, _mm256_loadu_si256((const __m256i*) (pSqSumPrev + x))));
+          _mm256_storeu_si256((__m256i*) (pSqSum + x + 4),
+                              _mm256_add_epi64(vSqSumHigh, _mm256_loadu_si256((const __m256i*) (pSqSumPrev + x + 4))));
+        }
+        rowSum = _mm256_cvtsi256_si32(vRowSum);
+        int64 rowSqSumLanes[4];
+        _mm256_storeu_si256((__m256i*) rowSqSumLanes, vRowSqSum);
+        rowSqSum = rowSqSumLanes[0];
+#elif defined(BOOSTING_INTEGRAL_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        __m128i vRowSum = _mm_set1_epi32(rowSum);
+        __m128i vRowSqSum = _mm_set_epi32((int) (rowSqSum >> 32), (int) rowSqSum, (int) (rowSqSum >> 32),
+                                          (int) rowSqSum);
+        for (; x + 4 <= width; x += 4)
+        {
+          int packed;
+          memcpy(&packed, pSrc + x, sizeof(packed));
+          __m128i pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+
+          __m128i vSum = _mm_add_epi32(integralPrefix4(pixels), vRowSum);
+          vRowSum = _mm_shuffle_epi32(vSum, 0xFF);
+          _mm_storeu_si128((__m128i*) (pSum + x), _mm_add_epi32(vSum, _mm_loadu_si128((const __m128i*) (pSumPrev + x))));
+
+          // every 32-bit lane holds one pixel in its low half, so madd yields the plain squares
+          __m128i vSqSum = integralPrefix4(_mm_madd_epi16(pixels, pixels));
+          __m128i vSqSumLow = _mm_add_epi64(_mm_unpacklo_epi32(vSqSum, zero), vRowSqSum);
+          __m128i vSqSumHigh = _mm_add_epi64(_mm_unpackhi_epi32(vSqSum, zero), vRowSqSum);
+          vRowSqSum = _mm_unpackhi_epi64(vSqSumHigh, vSqSumHigh);
+          _mm_storeu_si128((__m128i*) (pSqSum + x),
+                           _mm_add_epi64(vSqSumLow, _mm_loadu_si128((const __m128i*) (pSqSumPrev + x))));
+          _mm_storeu_si128((__m128i*) (pSqSum + x + 2),
+                           _mm_add_epi64(vSqSumHigh, _mm_loadu_si128((const __m128i*) (pSqSumPrev + x + 2))));
+        }
+        rowSum = _mm_cvtsi128_si32(vRowSum);
+        int64 rowSqSumLanes[2];
+        _mm_storeu_si128((__m128i*) rowSqSumLanes, vRowSqSum);
+        rowSqSum = rowSqSumLanes[0];
+#elif defined(BOOSTING_INTEGRAL_NEON)
+        uint32x4_t vRowSum = vdupq_n_u32((uint32_t) rowSum);
+        uint64x2_t vRowSqSum = vdupq_n_u64((uint64_t) rowSqSum);
+        for (; x + 8 <= width; x += 8)
+        {
+          uint16x8_t pixels = vmovl_u8(vld1_u8(pSrc + x));
+          integralBlock4(vget_low_u16(pixels), pSumPrev + x, pSum + x, pSqSumPrev + x, pSqSum + x, vRowSum, vRowSqSum);
+          integralBlock4(vget_high_u16(pixels), pSumPrev + x + 4, pSum + x + 4, pSqSumPrev + x + 4, pSqSum + x + 4,
+                         vRowSum, vRowSqSum);
+        }
+        rowSum = (int) vgetq_lane_u32(vRowSum, 0);
+        rowSqSum = (int64) vgetq_lane_u64(vRowSqSum, 0);
+#endif
+
+        for (; x < width; x++)
+        {
+          int value = pSrc[x];
+          rowSum += value;
+          rowSqSum += value * value;
+          pSum[x] = pSumPrev[x] + rowSum;
+          pSqSum[x] = pSqSumPrev[x] + rowSqSum;
+        }
+      }
+    }
+
     ImageRepresentation::ImageRepresentation(const cv::Mat & image, Size imageSize)
         :
-          m_useVariance(false)
+          m_useVariance(false),
+          m_useResponseCache(false),
+          m_varianceValid(false),
+          m_varianceMapValid(false),
+          m_numResponseSlots(0),
+          m_nextResponseSlot(0),
+          m_lastResponseSlot(-1)
     {
       // call the default initialization
       this->defaultInit(image, imageSize);
@@ -111,7 +362,13 @@ namespace cv
 
     ImageRepresentation::ImageRepresentation(const cv::Mat & image, Size imageSize, Rect imageROI)
         :
-          m_useVariance(false)
+          m_useVariance(false),
+          m_useResponseCache(false),
+          m_varianceValid(false),
+          m_varianceMapValid(false),
+          m_numResponseSlots(0),
+          m_nextResponseSlot(0),
+          m_lastResponseSlot(-1)
     {
       this->m_imageSize = imageSize;
 
@@ -146,6 +403,7 @@ namespace cv
     {
       this->m_ROI = ROI;
       m_offset = cv::Point2i(ROI.x, ROI.y);
+      invalidateCaches();
       return;
     }
 
@@ -162,6 +420,58 @@ namespace cv
       this->createIntegralsOfROI(image);
     }
 
+    void
+    ImageRepresentation::setNewImageAndROI(const cv::Mat & image, Rect ROI, Rect changedRect)
+    {
+      // the image has to differ from the previous one only within changedRect
+      if (intImage.empty() || (ROI & m_ROI) != ROI)
+      {
+        // the tables do not cover the new ROI, integrate it again with a margin of a quarter of its size on
+        // every side, so that the tables can be reused while the ROI shifts over the next frames
+        Rect grownROI(ROI.x - ROI.width / 4, ROI.y - ROI.height / 4, ROI.width + 2 * (ROI.width / 4),
+                      ROI.height + 2 * (ROI.height / 4));
+        this->setNewROI(grownROI & Rect(0, 0, image.cols, image.rows));
+        this->createIntegralsOfROI(image);
+        return;
+      }
+
+      // sums of rects inside the new ROI do not depend on how far the tables reach beyond it
+      changedRect &= m_ROI;
+      if (changedRect.width > 0 && changedRect.height > 0)
+        this->updateIntegralsOfROI(image, changedRect);
+    }
+
+    void
+    ImageRepresentation::setNewImageAndROI(const cv::Mat & image, Rect ROI, const cv::Mat & changedMask)
+    {
+      // every element of the mask flags a tile of the image, e.g. a mask with a single column flags whole rows
+      assert(changedMask.type() == CV_8UC1 && !changedMask.empty());
+      int tileWidth = (image.cols + changedMask.cols - 1) / changedMask.cols;
+      int tileHeight = (image.rows + changedMask.rows - 1) / changedMask.rows;
+
+      int minX = changedMask.cols, minY = changedMask.rows, maxX = -1, maxY = -1;
+      for (int y = 0; y < changedMask.rows; y++)
+      {
+        const uchar* pMask = changedMask.ptr<uchar>(y);
+        for (int x = 0; x < changedMask.cols; x++)
+        {
+          if (pMask[x] == 0)
+            continue;
+          minX = std::min(minX, x);
+          maxX = std::max(maxX, x);
+          minY = std::min(minY, y);
+          maxY = y;
+        }
+      }
+
+      Rect changedRect;
+      if (maxX >= 0)
+        changedRect = Rect(minX * tileWidth, minY * tileHeight, (maxX - minX + 1) * tileWidth,
+                           (maxY - minY + 1) * tileHeight) & Rect(0, 0, image.cols, image.rows);
+
+      this->setNewImageAndROI(image, ROI, changedRect);
+    }
+
     unsigned int
     ImageRepresentation::getValue(cv::Point2i imagePosition)
     {
@@ -169,8 +479,8 @@ namespace cv
       return intImage(position.y, position.x);
     }
 
-    long
-    ImageRepresentation::getSqSum(Rect imageROI)
+    int64
+    ImageRepresentation::getSqSum(Rect imageROI) const
     {
       // left upper Origin
       int OriginX = imageROI.x - m_offset.x;
@@ -185,17 +495,168 @@ namespace cv
       if (OriginY + Height >= m_ROI.height)
         Height = m_ROI.height - OriginY;
 
-      long int value = intSqImage(OriginY + Height, OriginX + Width) + intSqImage(OriginY, OriginX)
-          - intSqImage(OriginY, OriginX + Width) - intSqImage(OriginY + Height, OriginX);
+      int64 value = intSqImage.ptr<int64>(OriginY + Height)[OriginX + Width] + intSqImage.ptr<int64>(OriginY)[OriginX]
+          - intSqImage.ptr<int64>(OriginY)[OriginX + Width] - intSqImage.ptr<int64>(OriginY + Height)[OriginX];
 
       assert(value >= 0);
 
-      return (long) value;
+      return value;
+
+    }
+
+    void
+    ImageRepresentation::invalidateCaches()
+    {
+      m_varianceValid = m_varianceMapValid = false;
+      m_numResponseSlots = 0;
+      m_lastResponseSlot = -1;
+    }
+
+    int
+    ImageRepresentation::findResponseSlot(Rect imageROI, bool create)
+    {
+      // the features are mostly evaluated on one patch after another
+      if (m_lastResponseSlot >= 0 && m_responseSlots[m_lastResponseSlot].ROI == imageROI)
+        return m_lastResponseSlot;
+
+      for (int curSlot = 0; curSlot < m_numResponseSlots; curSlot++)
+      {
+        if (m_responseSlots[curSlot].ROI == imageROI)
+          return m_lastResponseSlot = curSlot;
+      }
+
+      if (!create)
+        return -1;
+
+      int slot;
+      if (m_numResponseSlots < MAX_RESPONSE_ROIS)
+      {
+        slot = m_numResponseSlots++;
+        if (slot == static_cast<int>(m_responseSlots.size()))
+        {
+          m_responseSlots.push_back(ResponseSlot());
+          m_responseSlots[slot].generation = 0;
+          m_responseSlots[slot].ids.resize(RESPONSE_SLOT_INIT_SIZE);
+          m_responseSlots[slot].generations.assign(RESPONSE_SLOT_INIT_SIZE, 0);
+          m_responseSlots[slot].responses.resize(RESPONSE_SLOT_INIT_SIZE);
+        }
+      }
+      else
+      {
+        slot = m_nextResponseSlot;
+        m_nextResponseSlot = (m_nextResponseSlot + 1) % MAX_RESPONSE_ROIS;
+      }
+
+      // the entries of the previous ROI become stale
+      m_responseSlots[slot].ROI = imageROI;
+      m_responseSlots[slot].generation++;
+      m_responseSlots[slot].numEntries = 0;
+      return m_lastResponseSlot = slot;
+    }
+
+    bool
+    ImageRepresentation::getCachedResponse(uint64 featureId, Rect imageROI, float* response)
+    {
+      int slot = findResponseSlot(imageROI, false);
+      if (slot < 0)
+        return false;
+
+      const ResponseSlot & responseSlot = m_responseSlots[slot];
+      int mask = static_cast<int>(responseSlot.ids.size()) - 1;
+      for (int pos = (int) featureId & mask; responseSlot.generations[pos] == responseSlot.generation;
+          pos = (pos + 1) & mask)
+      {
+        if (responseSlot.ids[pos] == featureId)
+        {
+          *response = responseSlot.responses[pos];
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void
+    ImageRepresentation::setCachedResponse(uint64 featureId, Rect imageROI, float response)
+    {
+      ResponseSlot & responseSlot = m_responseSlots[findResponseSlot(imageROI, true)];
+
+      // keep the table at most half full
+      if (2 * (responseSlot.numEntries + 1) > static_cast<int>(responseSlot.ids.size()))
+      {
+        std::vector<uint64> ids(2 * responseSlot.ids.size());
+        std::vector<int> generations(ids.size(), responseSlot.generation - 1);
+        std::vector<float> responses(ids.size());
+        int mask = static_cast<int>(ids.size()) - 1;
+        for (size_t curEntry = 0; curEntry < responseSlot.ids.size(); curEntry++)
+        {
+          if (responseSlot.generations[curEntry] != responseSlot.generation)
+            continue;
+          int pos = (int) responseSlot.ids[curEntry] & mask;
+          while (generations[pos] == responseSlot.generation)
+            pos = (pos + 1) & mask;
+          ids[pos] = responseSlot.ids[curEntry];
+          generations[pos] = responseSlot.generation;
+          responses[pos] = responseSlot.responses[curEntry];
+        }
+        responseSlot.ids.swap(ids);
+        responseSlot.generations.swap(generations);
+        responseSlot.responses.swap(responses);
+      }
 
+      int mask = static_cast<int>(responseSlot.ids.size()) - 1;
+      int pos = (int) featureId & mask;
+      while (responseSlot.generations[pos] == responseSlot.generation)
+      {
+        if (responseSlot.ids[pos] == featureId)
+        {
+          responseSlot.responses[pos] = response;
+          return;
+        }
+        pos = (pos + 1) & mask;
+      }
+      responseSlot.ids[pos] = featureId;
+      responseSlot.generations[pos] = responseSlot.generation;
+      responseSlot.responses[pos] = response;
+      responseSlot.numEntries++;
     }
 
     float
     ImageRepresentation::getVariance(Rect imageROI)
+    {
+      // the classifiers evaluate all their features on the same patch one after another
+      if (m_varianceValid && imageROI == m_varianceROI)
+        return m_variance;
+
+      m_variance = computeVariance(imageROI);
+      m_varianceROI = imageROI;
+      m_varianceValid = true;
+      return m_variance;
+    }
+
+    const cv::Mat_<float> &
+    ImageRepresentation::getVarianceMap(Rect firstPatch, Size step, Size grid)
+    {
+      if (!m_varianceMapValid || firstPatch != m_varianceMapPatch || step != m_varianceMapStep
+          || grid != m_varianceMap.size())
+      {
+        m_varianceMap.create(grid.height, grid.width);
+        for (int row = 0; row < grid.height; row++)
+        {
+          float* pVariance = m_varianceMap[row];
+          for (int col = 0; col < grid.width; col++)
+            pVariance[col] = computeVariance(
+                Rect(firstPatch.x + col * step.width, firstPatch.y + row * step.height, firstPatch.width,
+                     firstPatch.height));
+        }
+        m_varianceMapPatch = firstPatch;
+        m_varianceMapStep = step;
+        m_varianceMapValid = true;
+      }
+      return m_varianceMap;
+    }
+
+    float
+    ImageRepresentation::computeVariance(Rect imageROI) const
     {
       double area = imageROI.height * imageROI.width;
       double mean = (double) getSum(imageROI) / area;
@@ -210,7 +671,7 @@ namespace cv
     }
 
     int
-    ImageRepresentation::getSum(Rect imageROI)
+    ImageRepresentation::getSum(Rect imageROI) const
     {
       // left upper Origin
       int OriginX = imageROI.x - m_offset.x;
@@ -253,7 +714,47 @@ namespace cv
     void
     ImageRepresentation::createIntegralsOfROI(const cv::Mat & image)
     {
-      cv::integral(image(m_ROI), intImage, intSqImage, CV_32S);
+      assert(image.type() == CV_8UC1);
+      invalidateCaches();
+      cv::Mat imageROI = image(m_ROI);
+
+      // keep the tables of the previous frame if the ROI size did not change, otherwise allocate them with rows
+      // padded to a multiple of 32 bytes (there is no 64-bit integer depth, so every squared sum takes up one
+      // element of a two-channel 32-bit matrix)
+      if (intImage.rows != imageROI.rows + 1 || intImage.cols != imageROI.cols + 1)
+      {
+        cv::Rect tableRect(0, 0, imageROI.cols + 1, imageROI.rows + 1);
+        intImage = cv::Mat_<int>(tableRect.height, (int) cv::alignSize(tableRect.width, 8))(tableRect);
+        intSqImage = cv::Mat(tableRect.height, (int) cv::alignSize(tableRect.width, 4), CV_32SC2)(tableRect);
+
+        // the first row and column are never written by the kernel
+        intImage.row(0).setTo(0);
+        intImage.col(0).setTo(0);
+        intSqImage.row(0).setTo(0);
+        intSqImage.col(0).setTo(0);
+      }
+
+      integralSumSqSum(imageROI.data, imageROI.step, imageROI.cols, imageROI.rows, (int*) intImage.data,
+                       intImage.step / sizeof(int), (int64*) intSqImage.data, intSqImage.step / sizeof(int64));
+    }
+
+    void
+    ImageRepresentation::updateIntegralsOfROI(const cv::Mat & image, Rect changedRect)
+    {
+      assert(image.type() == CV_8UC1);
+      invalidateCaches();
+
+      // a changed pixel only affects the table entries below and right of it, so the block from the top left
+      // corner of the changed rect to the end of the tables is integrated again, starting from the unchanged
+      // row above and column left of it
+      cv::Mat imageBlock = image(
+          Rect(changedRect.x, changedRect.y, m_ROI.x + m_ROI.width - changedRect.x,
+               m_ROI.y + m_ROI.height - changedRect.y));
+      cv::Point2i tablePosition = changedRect.tl() - m_offset;
+
+      integralSumSqSum(imageBlock.data, imageBlock.step, imageBlock.cols, imageBlock.rows,
+                       &intImage(tablePosition.y, tablePosition.x), intImage.step / sizeof(int),
+                       intSqImage.ptr<int64>(tablePosition.y) + tablePosition.x, intSqImage.step / sizeof(int64));
     }
 
     Patches::Patches(void)
@@ -327,7 +828,7 @@ namespace cv
     }
 
     Rect
-    Patches::getSpecialRect(const char* what)
+    Patches::getSpecialRect(SpecialRect what)
     {
       Rect r;
       r.height = -1;
@@ -338,7 +839,7 @@ namespace cv
     }
 
     Rect
-    Patches::getSpecialRect(const char* what, Size patchSize)
+    Patches::getSpecialRect(SpecialRect what, Size patchSize)
     {
       Rect r;
       r.height = -1;
@@ -348,6 +849,19 @@ namespace cv
       return r;
     }
 
+    std::vector<Size>
+    Patches::getPatchSizes()
+    {
+      std::vector<Size> patchSizes;
+      for (int curPatch = 0; curPatch < num; curPatch++)
+      {
+        Size patchSize(patches[curPatch].width, patches[curPatch].height);
+        if (std::find(patchSizes.begin(), patchSizes.end(), patchSize) == patchSizes.end())
+          patchSizes.push_back(patchSize);
+      }
+      return patchSizes;
+    }
+
     Rect
     Patches::getROI()
     {
@@ -393,53 +907,45 @@ namespace cv
         stepCol = 1;
       if (stepRow <= 0)
         stepRow = 1;
+      m_patchStep = cv::Size(stepCol, stepRow);
+      m_patchSize = patchSize;
 
       m_patchGrid.height = ((int) ((float) (ROI.height - patchSize.height) / stepRow) + 1);
       m_patchGrid.width = ((int) ((float) (ROI.width - patchSize.width) / stepCol) + 1);
 
       num = m_patchGrid.width * m_patchGrid.height;
-      patches.resize(num);
-      int curPatch = 0;
-
-      m_rectUpperLeft = m_rectUpperRight = m_rectLowerLeft = m_rectLowerRight = cv::Rect(0, 0, patchSize.width,
-                                                                                         patchSize.height);
-      m_rectUpperLeft.y = ROI.y;
-      m_rectUpperLeft.x = ROI.x;
-      m_rectUpperRight.y = ROI.y;
-      m_rectUpperRight.x = ROI.x + ROI.width - patchSize.width;
-      m_rectLowerLeft.y = ROI.y + ROI.height - patchSize.height;
-      m_rectLowerLeft.x = ROI.x;
-      m_rectLowerRight.y = ROI.y + ROI.height - patchSize.height;
-      m_rectLowerRight.x = ROI.x + ROI.width - patchSize.width;
 
-      numPatchesX = 0;
-      numPatchesY = 0;
-      for (int curRow = 0; curRow < ROI.height - patchSize.height + 1; curRow += stepRow)
-      {
-        numPatchesY++;
+      numPatchesX = (ROI.width >= patchSize.width) ? (ROI.width - patchSize.width) / stepCol + 1 : 0;
+      numPatchesY = (ROI.height >= patchSize.height) ? (ROI.height - patchSize.height) / stepRow + 1 : 0;
+      assert(numPatchesX * numPatchesY == num);
+    }
 
-        for (int curCol = 0; curCol < ROI.width - patchSize.width + 1; curCol += stepCol)
-        {
-          if (curRow == 0)
-            numPatchesX++;
+    PatchesRegularScan::~PatchesRegularScan(void)
+    {
+    }
 
-          patches[curPatch].width = patchSize.width;
-          patches[curPatch].height = patchSize.height;
-          patches[curPatch].y = curRow + ROI.y;
-          patches[curPatch].x = curCol + ROI.x;
-          curPatch++;
-        }
-      }
+    Rect
+    PatchesRegularScan::getRect(int index)
+    {
+      if (index >= num)
+        return Rect(-1, -1, -1, -1);
+      if (index < 0)
+        return Rect(-1, -1, -1, -1);
 
-      assert(curPatch==num);
+      int curRow = index / m_patchGrid.width;
+      int curCol = index - curRow * m_patchGrid.width;
+      return Rect(ROI.x + curCol * m_patchStep.width, ROI.y + curRow * m_patchStep.height, m_patchSize.width,
+                  m_patchSize.height);
     }
 
-    PatchesRegularScan::~PatchesRegularScan(void)
+    std::vector<Size>
+    PatchesRegularScan::getPatchSizes()
     {
+      return std::vector<Size>(1, m_patchSize);
     }
 
     Rect
-    PatchesRegularScan::getSpecialRect(const char* what, Size patchSize)
+    PatchesRegularScan::getSpecialRect(SpecialRect what, Size patchSize)
     {
       Rect r;
       r.height = -1;
@@ -450,20 +956,21 @@ namespace cv
     }
 
     Rect
-    PatchesRegularScan::getSpecialRect(const char* what)
-    {
-      if (strcmp(what, "UpperLeft") == 0)
-        return m_rectUpperLeft;
-      if (strcmp(what, "UpperRight") == 0)
-        return m_rectUpperRight;
-      if (strcmp(what, "LowerLeft") == 0)
-        return m_rectLowerLeft;
-      if (strcmp(what, "LowerRight") == 0)
-        return m_rectLowerRight;
-      if (strcmp(what, "Random") == 0)
-      {
-        int index = (rand() % (num));
-        return patches[index];
+    PatchesRegularScan::getSpecialRect(SpecialRect what)
+    {
+      switch (what)
+      {
+        case UPPER_LEFT:
+          return Rect(ROI.x, ROI.y, m_patchSize.width, m_patchSize.height);
+        case UPPER_RIGHT:
+          return Rect(ROI.x + ROI.width - m_patchSize.width, ROI.y, m_patchSize.width, m_patchSize.height);
+        case LOWER_LEFT:
+          return Rect(ROI.x, ROI.y + ROI.height - m_patchSize.height, m_patchSize.width, m_patchSize.height);
+        case LOWER_RIGHT:
+          return Rect(ROI.x + ROI.width - m_patchSize.width, ROI.y + ROI.height - m_patchSize.height,
+                      m_patchSize.width, m_patchSize.height);
+        case RANDOM:
+          return getRect(cv::theRNG().uniform(0, num));
       }
 
       // assert (false);
@@ -562,12 +1069,12 @@ namespace cv
     }
 
     Rect
-    PatchesRegularScaleScan::getSpecialRect(const char* what)
+    PatchesRegularScaleScan::getSpecialRect(SpecialRect what)
     {
 
-      if (strcmp(what, "Random") == 0)
+      if (what == RANDOM)
       {
-        int index = (rand() % (num));
+        int index = cv::theRNG().uniform(0, num);
         return patches[index];
       }
 
@@ -579,42 +1086,47 @@ namespace cv
       return r;
     }
     Rect
-    PatchesRegularScaleScan::getSpecialRect(const char* what, Size patchSize)
+    PatchesRegularScaleScan::getSpecialRect(SpecialRect what, Size patchSize)
     {
-      if (strcmp(what, "UpperLeft") == 0)
+      if (what == UPPER_LEFT)
       {
         return cv::Rect(ROI.x, ROI.y, patchSize.width, patchSize.height);
       }
-      if (strcmp(what, "UpperRight") == 0)
+      if (what == UPPER_RIGHT)
       {
         return cv::Rect(ROI.x + ROI.width - patchSize.width, ROI.y, patchSize.width, patchSize.height);
       }
-      if (strcmp(what, "LowerLeft") == 0)
+      if (what == LOWER_LEFT)
       {
         return cv::Rect(ROI.x, ROI.y + ROI.height - patchSize.height, patchSize.width, patchSize.height);
       }
-      if (strcmp(what, "LowerRight") == 0)
+      if (what == LOWER_RIGHT)
       {
         return cv::Rect(ROI.x + ROI.width - patchSize.width, ROI.y + ROI.height - patchSize.height, patchSize.width,
                         patchSize.height);
       }
-      if (strcmp(what, "Random") == 0)
+      if (what == RANDOM)
       {
-        int index = (rand() % (num));
+        int index = cv::theRNG().uniform(0, num);
         return patches[index];
       }
 
       return Rect(-1, -1, -1, -1);
     }
 
+#define GAUSS_INIT_P 1000.0f
+#define MIN_PARALLEL_WEAK_CLASSIFIERS 512
+#define UPDATE_CHUNK_SIZE 128
+#define GAUSS_R_MEAN 0.01f
+#define GAUSS_R_SIGMA 0.01f
     EstimatedGaussDistribution::EstimatedGaussDistribution()
     {
       m_mean = 0;
       m_sigma = 1;
-      this->m_P_mean = 1000;
-      this->m_R_mean = 0.01f;
-      this->m_P_sigma = 1000;
-      this->m_R_sigma = 0.01f;
+      this->m_P_mean = GAUSS_INIT_P;
+      this->m_R_mean = GAUSS_R_MEAN;
+      this->m_P_sigma = GAUSS_INIT_P;
+      this->m_R_sigma = GAUSS_R_SIGMA;
     }
 
     EstimatedGaussDistribution::EstimatedGaussDistribution(float P_mean, float R_mean, float P_sigma, float R_sigma)
@@ -632,33 +1144,46 @@ namespace cv
     }
 
     void
-    EstimatedGaussDistribution::update(float value)
+    EstimatedGaussDistribution::update(float value, int numUpdates)
     {
       //update distribution (mean and sigma) using a kalman filter for each
 
       float K;
       float minFactor = 0.001f;
 
-      //mean
+      // the gains change with every update, so repeated updates are run as a scalar loop on the registers
+      float mean = m_mean;
+      float sigma = m_sigma;
+      float P_mean = m_P_mean;
+      float P_sigma = m_P_sigma;
 
-      K = m_P_mean / (m_P_mean + m_R_mean);
-      if (K < minFactor)
-        K = minFactor;
+      for (int curUpdate = 0; curUpdate < numUpdates; curUpdate++)
+      {
+        //mean
+
+        K = P_mean / (P_mean + m_R_mean);
+        if (K < minFactor)
+          K = minFactor;
 
-      m_mean = K * value + (1.0f - K) * m_mean;
-      m_P_mean = m_P_mean * m_R_mean / (m_P_mean + m_R_mean);
+        mean = K * value + (1.0f - K) * mean;
+        P_mean = P_mean * m_R_mean / (P_mean + m_R_mean);
 
-      K = m_P_sigma / (m_P_sigma + m_R_sigma);
-      if (K < minFactor)
-        K = minFactor;
+        K = P_sigma / (P_sigma + m_R_sigma);
+        if (K < minFactor)
+          K = minFactor;
 
-      float tmp_sigma = K * (m_mean - value) * (m_mean - value) + (1.0f - K) * m_sigma * m_sigma;
-      m_P_sigma = m_P_sigma * m_R_mean / (m_P_sigma + m_R_sigma);
+        float tmp_sigma = K * (mean - value) * (mean - value) + (1.0f - K) * sigma * sigma;
+        P_sigma = P_sigma * m_R_mean / (P_sigma + m_R_sigma);
 
-      m_sigma = static_cast<float>(sqrt(tmp_sigma));
-      if (m_sigma <= 1.0f)
-        m_sigma = 1.0f;
+        sigma = static_cast<float>(sqrt(tmp_sigma));
+        if (sigma <= 1.0f)
+          sigma = 1.0f;
+      }
 
+      m_mean = mean;
+      m_sigma = sigma;
+      m_P_mean = P_mean;
+      m_P_sigma = P_sigma;
     }
 
     void
@@ -669,21 +1194,52 @@ namespace cv
     }
 
 #define SQROOTHALF 0.7071
+#define MAX_SCALED_LAYOUTS 32
+#define NUM_POSITIVE_VOTES 8
+#define CASCADE_CHECK_STAGES 8
 #define INITSIGMA( numAreas ) ( static_cast<float>( sqrt( 256.0f*256.0f / 12.0f * (numAreas) ) ) );
 
-    FeatureHaar::FeatureHaar(Size patchSize)
+    static uint64
+    newFeatureId()
+    {
+      static uint64 nextFeatureId = 0;
+      uint64 id;
+#ifdef _OPENMP
+#pragma omp critical(newFeatureId)
+#endif
+      id = nextFeatureId++;
+      return id;
+    }
+
+    FeatureHaar::FeatureHaar(Size patchSize, cv::RNG & rng)
+        :
+          m_id(newFeatureId())
     {
       try
       {
-        generateRandomFeature(patchSize);
+        generateRandomFeature(patchSize, rng);
       } catch (...)
       {
         throw;
       }
     }
 
+    FeatureHaar::FeatureHaar()
+        :
+          m_id(newFeatureId()),
+          m_type(0),
+          m_numAreas(0),
+          m_initMean(0),
+          m_initSigma(0),
+          m_numLayouts(0),
+          m_curLayout(0),
+          m_nextLayout(1),
+          m_response(0)
+    {
+    }
+
     void
-    FeatureHaar::generateRandomFeature(Size patchSize)
+    FeatureHaar::generateRandomFeature(Size patchSize, cv::RNG & rng)
     {
       cv::Point2i position;
       Size baseDim;
@@ -697,17 +1253,17 @@ namespace cv
       while (!valid)
       {
         //chosse position and scale
-        position.y = rand() % (patchSize.height);
-        position.x = rand() % (patchSize.width);
+        position.y = rng.uniform(0, patchSize.height);
+        position.x = rng.uniform(0, patchSize.width);
 
-        baseDim.width = (int) ((1 - sqrt(1 - (float) rand() / RAND_MAX)) * patchSize.width);
-        baseDim.height = (int) ((1 - sqrt(1 - (float) rand() / RAND_MAX)) * patchSize.height);
+        baseDim.width = (int) ((1 - sqrt(1 - rng.uniform(0.0f, 1.0f))) * patchSize.width);
+        baseDim.height = (int) ((1 - sqrt(1 - rng.uniform(0.0f, 1.0f))) * patchSize.height);
 
         //select types
         //float probType[11] = {0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0909f, 0.0950f};
         float probType[11] =
         { 0.2f, 0.2f, 0.2f, 0.2f, 0.2f, 0.2f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-        float prob = (float) rand() / RAND_MAX;
+        float prob = rng.uniform(0.0f, 1.0f);
 
         if (prob < probType[0])
         {
@@ -1108,257 +1664,739 @@ namespace cv
       }
 
       m_initSize = patchSize;
-      m_curSize = m_initSize;
-      m_scaleFactorWidth = m_scaleFactorHeight = 1.0f;
-      m_scaleAreas.resize(m_numAreas);
-      m_scaleWeights.resize(m_numAreas);
+      resetLayouts();
+    }
+
+    void
+    FeatureHaar::resetLayouts()
+    {
+      // the layouts of a previous feature are kept, so their memory is reused when the feature is regenerated
+      if (m_layouts.empty())
+        m_layouts.resize(1);
+      scaleLayout(m_layouts[0], m_initSize);
+      m_numLayouts = 1;
+      m_curLayout = 0;
+      m_nextLayout = 1;
+    }
+
+    void
+    FeatureHaar::regenerate(Size patchSize, cv::RNG & rng)
+    {
+      m_id = newFeatureId();
+      generateRandomFeature(patchSize, rng);
+    }
+
+    void
+    FeatureHaar::swap(FeatureHaar & other)
+    {
+      std::swap(m_id, other.m_id);
+      std::swap(m_type, other.m_type);
+      std::swap(m_numAreas, other.m_numAreas);
+      m_weights.swap(other.m_weights);
+      std::swap(m_initMean, other.m_initMean);
+      std::swap(m_initSigma, other.m_initSigma);
+      m_areas.swap(other.m_areas);
+      std::swap(m_initSize, other.m_initSize);
+      m_layouts.swap(other.m_layouts);
+      std::swap(m_numLayouts, other.m_numLayouts);
+      std::swap(m_curLayout, other.m_curLayout);
+      std::swap(m_nextLayout, other.m_nextLayout);
+      std::swap(m_response, other.m_response);
+    }
+
+    void
+    FeatureHaar::write(std::ostream & os) const
+    {
+      int header[4] = { m_type, m_numAreas, m_initSize.width, m_initSize.height };
+      writeValues(os, header, 4);
+      float init[2] = { m_initMean, m_initSigma };
+      writeValues(os, init, 2);
+      writeValues(os, &m_weights[0], m_numAreas);
       for (int curArea = 0; curArea < m_numAreas; curArea++)
-      {
-        m_scaleAreas[curArea] = m_areas[curArea];
-        m_scaleWeights[curArea] = (float) m_weights[curArea]
-            / (float) (m_areas[curArea].width * m_areas[curArea].height);
-      }
+        writeRect(os, m_areas[curArea]);
     }
 
     bool
-    FeatureHaar::eval(ImageRepresentation* image, Rect ROI, float* result)
+    FeatureHaar::read(std::istream & is)
     {
-      *result = 0.0f;
-      cv::Point2i offset;
-      offset = cv::Point2i(ROI.x, ROI.y);
+      int header[4];
+      float init[2];
+      if (!readValues(is, header, 4) || !readValues(is, init, 2))
+        return false;
+      if (header[1] < 1 || header[1] > MAX_SNAPSHOT_AREAS || header[2] < 1 || header[3] < 1)
+        return false;
+
+      m_type = header[0];
+      m_numAreas = header[1];
+      m_initSize = Size(header[2], header[3]);
+      m_initMean = init[0];
+      m_initSigma = init[1];
+      m_weights.resize(m_numAreas);
+      m_areas.resize(m_numAreas);
+      if (!readValues(is, &m_weights[0], m_numAreas))
+        return false;
+      // the areas have to lie within the patch the feature was generated for
+      Rect patch(0, 0, m_initSize.width, m_initSize.height);
+      for (int curArea = 0; curArea < m_numAreas; curArea++)
+      {
+        if (!readRect(is, m_areas[curArea]))
+          return false;
+        if (m_areas[curArea].width < 1 || m_areas[curArea].height < 1 || (m_areas[curArea] & patch) != m_areas[curArea])
+          return false;
+      }
+
+      // the cached responses belong to the feature this one replaces
+      m_id = newFeatureId();
+      resetLayouts();
+      return true;
+    }
 
+    void
+    FeatureHaar::scaleLayout(ScaledLayout & layout, Size patchSize) const
+    {
       // define the minimum size
       Size minSize = Size(3, 3);
 
-      // printf("in eval %d = %d\n",curSize.width,ROI.width );
+      layout.patchSize = patchSize;
+      layout.valid = true;
+      layout.compiledStep = -1;
+      layout.areas.resize(m_numAreas);
+      layout.weights.resize(m_numAreas);
 
-      if (m_curSize.width != ROI.width || m_curSize.height != ROI.height)
+      if (!(m_initSize == patchSize))
       {
-        m_curSize = cv::Size(ROI.width, ROI.height);
-        if (!(m_initSize == m_curSize))
+        float scaleFactorHeight = (float) patchSize.height / m_initSize.height;
+        float scaleFactorWidth = (float) patchSize.width / m_initSize.width;
+
+        for (int curArea = 0; curArea < m_numAreas; curArea++)
         {
-          m_scaleFactorHeight = (float) m_curSize.height / m_initSize.height;
-          m_scaleFactorWidth = (float) m_curSize.width / m_initSize.width;
+          Rect & area = layout.areas[curArea];
+          area.height = (int) floor((float) m_areas[curArea].height * scaleFactorHeight + 0.5f);
+          area.width = (int) floor((float) m_areas[curArea].width * scaleFactorWidth + 0.5f);
 
-          for (int curArea = 0; curArea < m_numAreas; curArea++)
+          if (area.height < minSize.height || area.width < minSize.width)
           {
-            m_scaleAreas[curArea].height = (int) floor((float) m_areas[curArea].height * m_scaleFactorHeight + 0.5f);
-            m_scaleAreas[curArea].width = (int) floor((float) m_areas[curArea].width * m_scaleFactorWidth + 0.5f);
-
-            if (m_scaleAreas[curArea].height < minSize.height || m_scaleAreas[curArea].width < minSize.width)
-            {
-              m_scaleFactorWidth = 0.0f;
-              return false;
-            }
-
-            m_scaleAreas[curArea].x = (int) floor((float) m_areas[curArea].x * m_scaleFactorWidth + 0.5f);
-            m_scaleAreas[curArea].y = (int) floor((float) m_areas[curArea].y * m_scaleFactorHeight + 0.5f);
-            m_scaleWeights[curArea] = (float) m_weights[curArea]
-                / (float) ((m_scaleAreas[curArea].width) * (m_scaleAreas[curArea].height));
+            layout.valid = false;
+            return;
           }
+
+          area.x = (int) floor((float) m_areas[curArea].x * scaleFactorWidth + 0.5f);
+          area.y = (int) floor((float) m_areas[curArea].y * scaleFactorHeight + 0.5f);
+          layout.weights[curArea] = (float) m_weights[curArea] / (float) ((area.width) * (area.height));
         }
-        else
+      }
+      else
+      {
+        for (int curArea = 0; curArea < m_numAreas; curArea++)
         {
-          m_scaleFactorWidth = m_scaleFactorHeight = 1.0f;
-          for (int curArea = 0; curArea < m_numAreas; curArea++)
-          {
-            m_scaleAreas[curArea] = m_areas[curArea];
-            m_scaleWeights[curArea] = (float) m_weights[curArea]
-                / (float) ((m_areas[curArea].width) * (m_areas[curArea].height));
-          }
+          layout.areas[curArea] = m_areas[curArea];
+          layout.weights[curArea] = (float) m_weights[curArea]
+              / (float) ((m_areas[curArea].width) * (m_areas[curArea].height));
         }
       }
 
-      if (m_scaleFactorWidth == 0.0f)
-        return false;
+      layout.bounds = layout.areas[0];
+      for (int curArea = 1; curArea < m_numAreas; curArea++)
+        layout.bounds |= layout.areas[curArea];
+    }
 
+    void
+    FeatureHaar::compileLayout(ScaledLayout & layout, int integralStep) const
+    {
+      // offsets of the four integral corners of every scaled area relative to the top left corner of the patch
+      layout.cornerOffsets.resize(4 * m_numAreas);
       for (int curArea = 0; curArea < m_numAreas; curArea++)
       {
-        *result += (float) image->getSum(
-            Rect(m_scaleAreas[curArea].x + offset.x, m_scaleAreas[curArea].y + offset.y, m_scaleAreas[curArea].width,
-                 m_scaleAreas[curArea].height))
-                   * m_scaleWeights[curArea];
+        const Rect & area = layout.areas[curArea];
+        int* corners = &layout.cornerOffsets[4 * curArea];
+        corners[0] = area.y * integralStep + area.x;
+        corners[1] = area.y * integralStep + area.x + area.width;
+        corners[2] = (area.y + area.height) * integralStep + area.x;
+        corners[3] = (area.y + area.height) * integralStep + area.x + area.width;
       }
+      layout.compiledStep = integralStep;
+    }
 
-      if (image->getUseVariance())
+    bool
+    FeatureHaar::scaleToPatchSize(Size patchSize)
+    {
+      if (m_layouts[m_curLayout].patchSize == patchSize)
+        return m_layouts[m_curLayout].valid;
+
+      for (int curLayout = 0; curLayout < m_numLayouts; curLayout++)
       {
-        float variance = (float) image->getVariance(ROI);
-        *result /= variance;
+        if (m_layouts[curLayout].patchSize == patchSize)
+        {
+          m_curLayout = curLayout;
+          return m_layouts[curLayout].valid;
+        }
       }
 
-      m_response = *result;
+      // add the new size, once the cache is full the layouts of other sizes than the initial one are replaced in turn
+      if (m_numLayouts < MAX_SCALED_LAYOUTS)
+      {
+        m_curLayout = m_numLayouts++;
+        if ((int) m_layouts.size() < m_numLayouts)
+          m_layouts.resize(m_numLayouts);
+      }
+      else
+      {
+        m_curLayout = m_nextLayout;
+        m_nextLayout = (m_nextLayout + 1 < MAX_SCALED_LAYOUTS) ? m_nextLayout + 1 : 1;
+      }
+      scaleLayout(m_layouts[m_curLayout], patchSize);
 
-      return true;
+      return m_layouts[m_curLayout].valid;
     }
 
-    void
-    FeatureHaar::getInitialDistribution(EstimatedGaussDistribution* distribution)
+    const FeatureHaar::ScaledLayout*
+    FeatureHaar::getLayout(Size patchSize, int integralStep, ScaledLayout & scratch) const
     {
-      distribution->setValues(m_initMean, m_initSigma);
-    }
+      for (int curLayout = 0; curLayout < m_numLayouts; curLayout++)
+      {
+        const ScaledLayout & layout = m_layouts[curLayout];
+        if (layout.patchSize == patchSize && (!layout.valid || layout.compiledStep == integralStep))
+          return &layout;
+      }
 
-    ClassifierThreshold::ClassifierThreshold()
-    {
-      m_posSamples = new EstimatedGaussDistribution();
-      m_negSamples = new EstimatedGaussDistribution();
-      m_threshold = 0.0f;
-      m_parity = 0;
+      scaleLayout(scratch, patchSize);
+      if (scratch.valid)
+        compileLayout(scratch, integralStep);
+      return &scratch;
     }
 
-    ClassifierThreshold::~ClassifierThreshold()
+    void
+    FeatureHaar::prepareScales(const std::vector<Size> & patchSizes, int integralStep)
     {
-      if (m_posSamples != NULL)
-        delete m_posSamples;
-      if (m_negSamples != NULL)
-        delete m_negSamples;
-    }
+      // nothing to do for the single size of a regular scan once the feature has been prepared for it
+      if (patchSizes.size() == 1 && m_layouts[m_curLayout].patchSize == patchSizes[0]
+          && (!m_layouts[m_curLayout].valid || integralStep < 0 || m_layouts[m_curLayout].compiledStep == integralStep))
+        return;
 
-    void*
-    ClassifierThreshold::getDistribution(int target)
-    {
-      if (target == 1)
-        return m_posSamples;
-      else
-        return m_negSamples;
+      for (size_t curSize = 0; curSize < patchSizes.size(); curSize++)
+      {
+        if (scaleToPatchSize(patchSizes[curSize]) && integralStep >= 0
+            && m_layouts[m_curLayout].compiledStep != integralStep)
+          compileLayout(m_layouts[m_curLayout], integralStep);
+      }
     }
 
-    void
-    ClassifierThreshold::update(float value, int target)
+    float
+    FeatureHaar::sumAreas(const ImageRepresentation* image, const ScaledLayout & layout, cv::Point2i offset) const
     {
-      //update distribution
-      if (target == 1)
-        m_posSamples->update(value);
+      float result = 0.0f;
+
+      if (image->isInsideIntegral(layout.bounds + offset))
+      {
+        // all areas lie within the integral tables, so no clamping is needed
+        const int* patch = image->getIntegralPtr(offset);
+        for (int curArea = 0; curArea < m_numAreas; curArea++)
+        {
+          const int* corners = &layout.cornerOffsets[4 * curArea];
+          result += (float) (patch[corners[3]] + patch[corners[0]] - patch[corners[1]] - patch[corners[2]])
+                    * layout.weights[curArea];
+        }
+      }
       else
-        m_negSamples->update(value);
+      {
+        for (int curArea = 0; curArea < m_numAreas; curArea++)
+        {
+          const Rect & area = layout.areas[curArea];
+          result += (float) image->getSum(Rect(area.x + offset.x, area.y + offset.y, area.width, area.height))
+                    * layout.weights[curArea];
+        }
+      }
 
-      //adapt threshold and parity
-      m_threshold = (m_posSamples->getMean() + m_negSamples->getMean()) / 2.0f;
-      m_parity = (m_posSamples->getMean() > m_negSamples->getMean()) ? 1 : -1;
+      return result;
     }
 
-    int
-    ClassifierThreshold::eval(float value)
+    bool
+    FeatureHaar::eval(ImageRepresentation* image, Rect ROI, float* result)
     {
-      return (((m_parity * (value - m_threshold)) > 0) ? 1 : -1);
+      // the same patch is evaluated several times per frame, by the updates and by the prior classifier
+      bool useCache = image->getUseResponseCache();
+      if (useCache && image->getCachedResponse(m_id, ROI, result))
+      {
+        m_response = *result;
+        return true;
+      }
+
+      float variance = image->getUseVariance() ? (float) image->getVariance(ROI) : 1.0f;
+      if (!evalUncached(image, ROI, variance, result))
+        return false;
+
+      if (useCache)
+        image->setCachedResponse(m_id, ROI, *result);
+
+      return true;
     }
 
-    WeakClassifier::WeakClassifier()
+    bool
+    FeatureHaar::evalUncached(const ImageRepresentation* image, Rect ROI, float variance, float* result)
     {
+      *result = 0.0f;
+
+      if (!scaleToPatchSize(ROI.size()))
+        return false;
+
+      ScaledLayout & layout = m_layouts[m_curLayout];
+      int integralStep = image->getIntegralStep();
+      if (integralStep != layout.compiledStep)
+        compileLayout(layout, integralStep);
+
+      *result = sumAreas(image, layout, ROI.tl());
+
+      if (image->getUseVariance())
+        *result /= variance;
+
+      m_response = *result;
+
+      return true;
     }
 
-    WeakClassifier::~WeakClassifier()
+    bool
+    FeatureHaar::eval(const ImageRepresentation* image, Rect ROI, float variance, ScaledLayout & scratch,
+                      float* result) const
     {
+      *result = 0.0f;
+
+      const ScaledLayout* layout = getLayout(ROI.size(), image->getIntegralStep(), scratch);
+      if (!layout->valid)
+        return false;
+
+      *result = sumAreas(image, *layout, ROI.tl());
+
+      if (image->getUseVariance())
+        *result /= variance;
+
+      return true;
     }
 
     bool
-    WeakClassifier::update(ImageRepresentation* image, Rect ROI, int target)
+    FeatureHaar::evalRow(const ImageRepresentation* image, Rect firstPatch, int stepCol, int numPatches,
+                         const float* variances, ScaledLayout & scratch, float* results) const
     {
+      const ScaledLayout* layout = getLayout(firstPatch.size(), image->getIntegralStep(), scratch);
+      if (!layout->valid)
+        return false;
+
+      Rect rowBounds = layout->bounds + firstPatch.tl();
+      rowBounds.width += (numPatches - 1) * stepCol;
+      if (!image->isInsideIntegral(rowBounds))
+      {
+        for (int curPatch = 0; curPatch < numPatches; curPatch++)
+          results[curPatch] = sumAreas(image, *layout, cv::Point2i(firstPatch.x + curPatch * stepCol, firstPatch.y));
+      }
+      else
+      {
+        // sweep the row area by area, every patch sums up the areas in the same order as eval does
+        std::fill(results, results + numPatches, 0.0f);
+        const int* row = image->getIntegralPtr(firstPatch.tl());
+        for (int curArea = 0; curArea < m_numAreas; curArea++)
+        {
+          const int* topLeft = row + layout->cornerOffsets[4 * curArea];
+          const int* topRight = row + layout->cornerOffsets[4 * curArea + 1];
+          const int* bottomLeft = row + layout->cornerOffsets[4 * curArea + 2];
+          const int* bottomRight = row + layout->cornerOffsets[4 * curArea + 3];
+          float weight = layout->weights[curArea];
+
+          if (stepCol == 1)
+          {
+            for (int curPatch = 0; curPatch < numPatches; curPatch++)
+              results[curPatch] += (float) (bottomRight[curPatch] + topLeft[curPatch] - topRight[curPatch]
+                  - bottomLeft[curPatch]) * weight;
+          }
+          else
+          {
+            for (int curPatch = 0, x = 0; curPatch < numPatches; curPatch++, x += stepCol)
+              results[curPatch] += (float) (bottomRight[x] + topLeft[x] - topRight[x] - bottomLeft[x]) * weight;
+          }
+        }
+      }
+
+      if (image->getUseVariance())
+      {
+        for (int curPatch = 0; curPatch < numPatches; curPatch++)
+          results[curPatch] /= variances[curPatch];
+      }
+
       return true;
     }
 
-    int
-    WeakClassifier::eval(ImageRepresentation* image, Rect ROI)
+    void
+    FeatureHaar::getInitialDistribution(EstimatedGaussDistribution* distribution)
     {
-      return 0;
+      distribution->setValues(m_initMean, m_initSigma);
     }
 
-    int
-    WeakClassifier::getType()
+    WeakClassifierPool::WeakClassifierPool(int numWeakClassifier, Size patchSize, cv::RNG & rng, bool randomFeatures)
+        :
+          m_rng(&rng),
+          m_batchImage(NULL)
     {
-      return 0;
+      m_features.reserve(numWeakClassifier);
+      for (int curWeakClassifier = 0; curWeakClassifier < numWeakClassifier; curWeakClassifier++)
+        m_features.push_back(randomFeatures ? FeatureHaar(patchSize, rng) : FeatureHaar());
+
+      m_posMean.resize(numWeakClassifier);
+      m_posSigma.resize(numWeakClassifier);
+      m_posPMean.resize(numWeakClassifier);
+      m_posPSigma.resize(numWeakClassifier);
+      m_negMean.resize(numWeakClassifier);
+      m_negSigma.resize(numWeakClassifier);
+      m_negPMean.resize(numWeakClassifier);
+      m_negPSigma.resize(numWeakClassifier);
+      m_threshold.resize(numWeakClassifier);
+      m_parity.resize(numWeakClassifier);
+      m_values.resize(numWeakClassifier);
+      m_valid.resize(numWeakClassifier);
+
+      for (int curWeakClassifier = 0; curWeakClassifier < numWeakClassifier; curWeakClassifier++)
+        initStatistics(curWeakClassifier);
     }
 
-    float
-    WeakClassifier::getValue(ImageRepresentation* image, Rect ROI)
+    void
+    WeakClassifierPool::initStatistics(int idx)
     {
-      return 0;
+      m_posMean[idx] = m_negMean[idx] = m_features[idx].getInitMean();
+      m_posSigma[idx] = m_negSigma[idx] = m_features[idx].getInitSigma();
+      m_posPMean[idx] = m_negPMean[idx] = GAUSS_INIT_P;
+      m_posPSigma[idx] = m_negPSigma[idx] = GAUSS_INIT_P;
+      m_threshold[idx] = 0.0f;
+      m_parity[idx] = 0.0f;
     }
 
-    WeakClassifierHaarFeature::WeakClassifierHaarFeature(Size patchSize)
+    void
+    WeakClassifierPool::prepareBatch(ImageRepresentation* image, const std::vector<Rect> & ROIs)
     {
-      m_feature = new FeatureHaar(patchSize);
-      generateRandomClassifier();
-      m_feature->getInitialDistribution((EstimatedGaussDistribution*) m_classifier->getDistribution(-1));
-      m_feature->getInitialDistribution((EstimatedGaussDistribution*) m_classifier->getDistribution(1));
+      // the trackers learn the same few patches over and over, so every distinct ROI is evaluated only once
+      m_batchROIs.clear();
+      m_batchSampleROI.resize(ROIs.size());
+      for (size_t curSample = 0; curSample < ROIs.size(); curSample++)
+      {
+        size_t curROI = 0;
+        while (curROI < m_batchROIs.size() && !(m_batchROIs[curROI] == ROIs[curSample]))
+          curROI++;
+        if (curROI == m_batchROIs.size())
+          m_batchROIs.push_back(ROIs[curSample]);
+        m_batchSampleROI[curSample] = static_cast<int>(curROI);
+      }
+
+      // the caches of the image are not used, so the batches of different classifiers can be prepared at once
+      m_batchImage = image;
+      m_batchVariances.resize(m_batchROIs.size());
+      for (size_t curROI = 0; curROI < m_batchROIs.size(); curROI++)
+        m_batchVariances[curROI] = image->getUseVariance() ? image->computeVariance(m_batchROIs[curROI]) : 1.0f;
+
+      int numWeakClassifier = getNumWeakClassifier();
+      m_batchValues.resize(numWeakClassifier * m_batchROIs.size());
+      m_batchValid.resize(numWeakClassifier * m_batchROIs.size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (numWeakClassifier >= MIN_PARALLEL_WEAK_CLASSIFIERS)
+#endif
+      for (int curWeakClassifier = 0; curWeakClassifier < numWeakClassifier; curWeakClassifier++)
+        evalBatch(curWeakClassifier);
     }
 
     void
-    WeakClassifierHaarFeature::resetPosDist()
+    WeakClassifierPool::clearBatch()
     {
-      m_feature->getInitialDistribution((EstimatedGaussDistribution*) m_classifier->getDistribution(1));
-      m_feature->getInitialDistribution((EstimatedGaussDistribution*) m_classifier->getDistribution(-1));
+      m_batchImage = NULL;
     }
 
-    WeakClassifierHaarFeature::~WeakClassifierHaarFeature()
+    int
+    WeakClassifierPool::evalBatchSample(int idx, int batchSample) const
     {
-      delete m_classifier;
-      delete m_feature;
+      int numROIs = static_cast<int>(m_batchROIs.size());
+      int curValue = idx * numROIs + m_batchSampleROI[batchSample];
+      if (!m_batchValid[curValue])
+        return 0;
 
+      return classify(idx, m_batchValues[curValue]);
     }
 
     void
-    WeakClassifierHaarFeature::generateRandomClassifier()
+    WeakClassifierPool::evalBatch(int idx)
     {
-      m_classifier = new ClassifierThreshold();
+      int numROIs = static_cast<int>(m_batchROIs.size());
+      float* values = &m_batchValues[idx * numROIs];
+      unsigned char* valid = &m_batchValid[idx * numROIs];
+      for (int curROI = 0; curROI < numROIs; curROI++)
+      {
+        valid[curROI] = m_features[idx].evalUncached(m_batchImage, m_batchROIs[curROI], m_batchVariances[curROI],
+                                                     &values[curROI]);
+        if (!valid[curROI])
+          values[curROI] = 0.0f;
+      }
     }
 
-    bool
-    WeakClassifierHaarFeature::update(ImageRepresentation *image, Rect ROI, int target)
+    void
+    WeakClassifierPool::update(ImageRepresentation* image, Rect ROI, int target, int numUpdates, bool* errorMask,
+                               int batchSample)
     {
-      float value;
+      int numWeakClassifier = getNumWeakClassifier();
+      bool fromBatch = batchSample >= 0 && m_batchImage != NULL;
+
+      // Large pools, like the one shared by the direct selection, are split up into chunks of weak classifiers
+      // for the threads, which OpenMP keeps alive between the updates. Every weak classifier only touches its
+      // own feature and statistics, the caches of the image are used by the calling thread only.
+#ifdef _OPENMP
+      bool parallel = numWeakClassifier >= MIN_PARALLEL_WEAK_CLASSIFIERS;
+#else
+      bool parallel = false;
+#endif
+      float variance = 1.0f;
+      if (!fromBatch && parallel && image->getUseVariance())
+        variance = (float) image->getVariance(ROI);
+      if (!fromBatch && !parallel)
+      {
+        for (int curWeakClassifier = 0; curWeakClassifier < numWeakClassifier; curWeakClassifier++)
+        {
+          m_valid[curWeakClassifier] = m_features[curWeakClassifier].eval(image, ROI, &m_values[curWeakClassifier]);
+          if (!m_valid[curWeakClassifier])
+            m_values[curWeakClassifier] = 0.0f;
+        }
+      }
+
+      int numChunks = (numWeakClassifier + UPDATE_CHUNK_SIZE - 1) / UPDATE_CHUNK_SIZE;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (parallel)
+#endif
+      for (int curChunk = 0; curChunk < numChunks; curChunk++)
+      {
+        int begin = curChunk * UPDATE_CHUNK_SIZE;
+        int end = std::min(begin + UPDATE_CHUNK_SIZE, numWeakClassifier);
 
-      bool valid = m_feature->eval(image, ROI, &value);
+        // the feature values are the same for all updates
+        if (fromBatch)
+        {
+          int numROIs = static_cast<int>(m_batchROIs.size());
+          int curROI = m_batchSampleROI[batchSample];
+          for (int curWeakClassifier = begin; curWeakClassifier < end; curWeakClassifier++)
+          {
+            m_values[curWeakClassifier] = m_batchValues[curWeakClassifier * numROIs + curROI];
+            m_valid[curWeakClassifier] = m_batchValid[curWeakClassifier * numROIs + curROI];
+          }
+        }
+        else if (parallel)
+        {
+          for (int curWeakClassifier = begin; curWeakClassifier < end; curWeakClassifier++)
+          {
+            m_valid[curWeakClassifier] = m_features[curWeakClassifier].evalUncached(image, ROI, variance,
+                                                                                    &m_values[curWeakClassifier]);
+            if (!m_valid[curWeakClassifier])
+              m_values[curWeakClassifier] = 0.0f;
+          }
+        }
+
+        updateDistributions(begin, end, target, numUpdates);
+        updateThresholds(begin, end, target, errorMask);
+      }
+    }
+
+    void
+    WeakClassifierPool::updateDistributions(int begin, int end, int target, int numUpdates)
+    {
+      //update distribution (mean and sigma) using a kalman filter for each
+      float* mean = (target == 1) ? &m_posMean[0] : &m_negMean[0];
+      float* sigma = (target == 1) ? &m_posSigma[0] : &m_negSigma[0];
+      float* P_mean = (target == 1) ? &m_posPMean[0] : &m_negPMean[0];
+      float* P_sigma = (target == 1) ? &m_posPSigma[0] : &m_negPSigma[0];
+      const float* values = &m_values[0];
+      const unsigned char* valid = &m_valid[0];
+      float minFactor = 0.001f;
+
+      for (int curUpdate = 0; curUpdate < numUpdates; curUpdate++)
+      {
+        // branch free, so the loop vectorizes, invalid features keep their distribution
+        for (int curWeakClassifier = begin; curWeakClassifier < end; curWeakClassifier++)
+        {
+          float value = values[curWeakClassifier];
+
+          float K = P_mean[curWeakClassifier] / (P_mean[curWeakClassifier] + GAUSS_R_MEAN);
+          K = (K < minFactor) ? minFactor : K;
+          float newMean = K * value + (1.0f - K) * mean[curWeakClassifier];
+          float newPMean = P_mean[curWeakClassifier] * GAUSS_R_MEAN / (P_mean[curWeakClassifier] + GAUSS_R_MEAN);
+
+          K = P_sigma[curWeakClassifier] / (P_sigma[curWeakClassifier] + GAUSS_R_SIGMA);
+          K = (K < minFactor) ? minFactor : K;
+          float tmp_sigma = K * (newMean - value) * (newMean - value)
+              + (1.0f - K) * sigma[curWeakClassifier] * sigma[curWeakClassifier];
+          float newPSigma = P_sigma[curWeakClassifier] * GAUSS_R_MEAN / (P_sigma[curWeakClassifier] + GAUSS_R_SIGMA);
+          float newSigma = sqrtf(tmp_sigma);
+          newSigma = (newSigma <= 1.0f) ? 1.0f : newSigma;
+
+          bool isValid = valid[curWeakClassifier] != 0;
+          mean[curWeakClassifier] = isValid ? newMean : mean[curWeakClassifier];
+          P_mean[curWeakClassifier] = isValid ? newPMean : P_mean[curWeakClassifier];
+          sigma[curWeakClassifier] = isValid ? newSigma : sigma[curWeakClassifier];
+          P_sigma[curWeakClassifier] = isValid ? newPSigma : P_sigma[curWeakClassifier];
+        }
+      }
+    }
+
+    void
+    WeakClassifierPool::updateThresholds(int begin, int end, int target, bool* errorMask)
+    {
+      //adapt threshold and parity
+      for (int curWeakClassifier = begin; curWeakClassifier < end; curWeakClassifier++)
+      {
+        if (!m_valid[curWeakClassifier])
+        {
+          errorMask[curWeakClassifier] = true;
+          continue;
+        }
+
+        m_threshold[curWeakClassifier] = (m_posMean[curWeakClassifier] + m_negMean[curWeakClassifier]) / 2.0f;
+        m_parity[curWeakClassifier] = (m_posMean[curWeakClassifier] > m_negMean[curWeakClassifier]) ? 1.0f : -1.0f;
+        errorMask[curWeakClassifier] = (classify(curWeakClassifier, m_values[curWeakClassifier]) != target);
+      }
+    }
+
+    int
+    WeakClassifierPool::eval(int idx, ImageRepresentation* image, Rect ROI)
+    {
+      float value;
+      bool valid = m_features[idx].eval(image, ROI, &value);
       if (!valid)
-        return true;
+        return 0;
 
-      m_classifier->update(value, target);
-      return (m_classifier->eval(value) != target);
+      return classify(idx, value);
     }
 
     int
-    WeakClassifierHaarFeature::eval(ImageRepresentation *image, Rect ROI)
+    WeakClassifierPool::eval(int idx, const ImageRepresentation* image, Rect ROI, float variance,
+                             EvalScratch & scratch) const
     {
       float value;
-      bool valid = m_feature->eval(image, ROI, &value);
+      bool valid = m_features[idx].eval(image, ROI, variance, scratch.layout, &value);
       if (!valid)
         return 0;
 
-      return m_classifier->eval(value);
+      return classify(idx, value);
+    }
+
+    void
+    WeakClassifierPool::evalGrid(int idx, const ImageRepresentation* image, Rect firstPatch, Size step, float alpha,
+                                 const cv::Mat_<float>* variances, cv::Mat_<float> & confidences,
+                                 EvalScratch & scratch) const
+    {
+      float threshold = m_threshold[idx];
+      float parity = m_parity[idx];
+
+      scratch.values.resize(confidences.cols);
+      for (int row = 0; row < confidences.rows; row++)
+      {
+        Rect rowPatch(firstPatch.x, firstPatch.y + row * step.height, firstPatch.width, firstPatch.height);
+
+        // invalid features do not vote
+        if (!m_features[idx].evalRow(image, rowPatch, step.width, confidences.cols,
+                                     variances != NULL ? (*variances)[row] : NULL, scratch.layout,
+                                     &scratch.values[0]))
+          return;
+
+        const float* values = &scratch.values[0];
+        float* pConfidences = confidences[row];
+        for (int col = 0; col < confidences.cols; col++)
+          pConfidences[col] += (((parity * (values[col] - threshold)) > 0) ? 1 : -1) * alpha;
+      }
     }
 
     float
-    WeakClassifierHaarFeature::getValue(ImageRepresentation *image, Rect ROI)
+    WeakClassifierPool::getValue(int idx, ImageRepresentation* image, Rect ROI)
     {
       float value;
-      bool valid = m_feature->eval(image, ROI, &value);
+      bool valid = m_features[idx].eval(image, ROI, &value);
       if (!valid)
         return 0;
 
       return value;
     }
 
-    EstimatedGaussDistribution*
-    WeakClassifierHaarFeature::getPosDistribution()
+    void
+    WeakClassifierPool::prepareScales(int idx, const std::vector<Size> & patchSizes, int integralStep)
+    {
+      m_features[idx].prepareScales(patchSizes, integralStep);
+    }
+
+    void
+    WeakClassifierPool::replace(int target, int source, Size patchSize)
+    {
+      // the feature objects are recycled, so the exchange does not allocate once the layouts have been grown
+      m_features[target].swap(m_features[source]);
+      m_posMean[target] = m_posMean[source];
+      m_posSigma[target] = m_posSigma[source];
+      m_posPMean[target] = m_posPMean[source];
+      m_posPSigma[target] = m_posPSigma[source];
+      m_negMean[target] = m_negMean[source];
+      m_negSigma[target] = m_negSigma[source];
+      m_negPMean[target] = m_negPMean[source];
+      m_negPSigma[target] = m_negPSigma[source];
+      m_threshold[target] = m_threshold[source];
+      m_parity[target] = m_parity[source];
+
+      m_features[source].regenerate(patchSize, *m_rng);
+      initStatistics(source);
+
+      if (m_batchImage != NULL)
+      {
+        int numROIs = static_cast<int>(m_batchROIs.size());
+        std::copy(m_batchValues.begin() + source * numROIs, m_batchValues.begin() + (source + 1) * numROIs,
+                  m_batchValues.begin() + target * numROIs);
+        std::copy(m_batchValid.begin() + source * numROIs, m_batchValid.begin() + (source + 1) * numROIs,
+                  m_batchValid.begin() + target * numROIs);
+        evalBatch(source);
+      }
+    }
+
+    void
+    WeakClassifierPool::write(std::ostream & os) const
     {
-      return static_cast<EstimatedGaussDistribution*>(m_classifier->getDistribution(1));
+      writeInt(os, static_cast<int>(m_features.size()));
+      for (size_t curWeakClassifier = 0; curWeakClassifier < m_features.size(); curWeakClassifier++)
+        m_features[curWeakClassifier].write(os);
+
+      writeFloats(os, m_posMean);
+      writeFloats(os, m_posSigma);
+      writeFloats(os, m_posPMean);
+      writeFloats(os, m_posPSigma);
+      writeFloats(os, m_negMean);
+      writeFloats(os, m_negSigma);
+      writeFloats(os, m_negPMean);
+      writeFloats(os, m_negPSigma);
+      writeFloats(os, m_threshold);
+      writeFloats(os, m_parity);
     }
 
-    EstimatedGaussDistribution*
-    WeakClassifierHaarFeature::getNegDistribution()
+    bool
+    WeakClassifierPool::read(std::istream & is)
     {
-      return static_cast<EstimatedGaussDistribution*>(m_classifier->getDistribution(-1));
+      clearBatch();
+
+      int numWeakClassifier;
+      if (!readInt(is, numWeakClassifier) || numWeakClassifier != getNumWeakClassifier())
+        return false;
+      for (int curWeakClassifier = 0; curWeakClassifier < numWeakClassifier; curWeakClassifier++)
+      {
+        if (!m_features[curWeakClassifier].read(is))
+          return false;
+      }
+
+      return readFloats(is, m_posMean) && readFloats(is, m_posSigma) && readFloats(is, m_posPMean)
+          && readFloats(is, m_posPSigma) && readFloats(is, m_negMean) && readFloats(is, m_negSigma)
+          && readFloats(is, m_negPMean) && readFloats(is, m_negPSigma) && readFloats(is, m_threshold)
+          && readFloats(is, m_parity);
     }
 
-    BaseClassifier::BaseClassifier(int numWeakClassifier, int iterationInit, Size patchSize)
+    BaseClassifier::BaseClassifier(int numWeakClassifier, int iterationInit, Size patchSize, cv::RNG & rng,
+                                   bool randomFeatures)
     {
       this->m_numWeakClassifier = numWeakClassifier;
       this->m_iterationInit = iterationInit;
 
-      weakClassifier = new WeakClassifier*[numWeakClassifier + iterationInit];
+      weakClassifier = new WeakClassifierPool(numWeakClassifier + iterationInit, patchSize, rng, randomFeatures);
       m_idxOfNewWeakClassifier = numWeakClassifier;
 
-      generateRandomClassifier(patchSize);
-
       m_referenceWeakClassifier = false;
       m_selectedClassifier = 0;
 
@@ -1370,7 +2408,7 @@ namespace cv
         m_wWrong[curWeakClassifier] = m_wCorrect[curWeakClassifier] = 1;
     }
 
-    BaseClassifier::BaseClassifier(int numWeakClassifier, int iterationInit, WeakClassifier** weakClassifier)
+    BaseClassifier::BaseClassifier(int numWeakClassifier, int iterationInit, WeakClassifierPool* weakClassifier)
     {
       this->m_numWeakClassifier = numWeakClassifier;
       this->m_iterationInit = iterationInit;
@@ -1389,41 +2427,99 @@ namespace cv
     BaseClassifier::~BaseClassifier()
     {
       if (!m_referenceWeakClassifier)
-      {
-        for (int curWeakClassifier = 0; curWeakClassifier < m_numWeakClassifier + m_iterationInit; curWeakClassifier++)
-          delete weakClassifier[curWeakClassifier];
-
-        delete[] weakClassifier;
-      }
+        delete weakClassifier;
       m_wCorrect.clear();
       m_wWrong.clear();
     }
 
     void
-    BaseClassifier::generateRandomClassifier(Size patchSize)
+    BaseClassifier::write(std::ostream & os) const
     {
-      for (int curWeakClassifier = 0; curWeakClassifier < m_numWeakClassifier + m_iterationInit; curWeakClassifier++)
-      {
-        weakClassifier[curWeakClassifier] = new WeakClassifierHaarFeature(patchSize);
-      }
+      int header[2] = { m_selectedClassifier, m_idxOfNewWeakClassifier };
+      writeValues(os, header, 2);
+      writeFloats(os, m_wCorrect);
+      writeFloats(os, m_wWrong);
+
+      // shared weak classifiers are written by the base classifier which owns them
+      if (!m_referenceWeakClassifier)
+        weakClassifier->write(os);
+    }
+
+    bool
+    BaseClassifier::read(std::istream & is)
+    {
+      int header[2];
+      if (!readValues(is, header, 2))
+        return false;
+      if (header[0] < 0 || header[0] >= m_numWeakClassifier + m_iterationInit || header[1] < 0
+          || header[1] >= m_numWeakClassifier + m_iterationInit)
+        return false;
+
+      m_selectedClassifier = header[0];
+      m_idxOfNewWeakClassifier = header[1];
+      if (!readFloats(is, m_wCorrect) || !readFloats(is, m_wWrong))
+        return false;
+
+      return m_referenceWeakClassifier || weakClassifier->read(is);
     }
 
     int
     BaseClassifier::eval(ImageRepresentation *image, Rect ROI)
     {
-      return weakClassifier[m_selectedClassifier]->eval(image, ROI);
+      return weakClassifier->eval(m_selectedClassifier, image, ROI);
+    }
+
+    void
+    BaseClassifier::prepareScales(const std::vector<Size> & patchSizes, int integralStep)
+    {
+      weakClassifier->prepareScales(m_selectedClassifier, patchSizes, integralStep);
+    }
+
+    int
+    BaseClassifier::eval(const ImageRepresentation *image, Rect ROI, float variance, EvalScratch & scratch) const
+    {
+      return weakClassifier->eval(m_selectedClassifier, image, ROI, variance, scratch);
+    }
+
+    int
+    BaseClassifier::evalBatchSample(int batchSample)
+    {
+      return weakClassifier->evalBatchSample(m_selectedClassifier, batchSample);
+    }
+
+    void
+    BaseClassifier::evalGrid(const ImageRepresentation *image, Rect firstPatch, Size step, float alpha,
+                             const cv::Mat_<float>* variances, cv::Mat_<float> & confidences,
+                             EvalScratch & scratch) const
+    {
+      weakClassifier->evalGrid(m_selectedClassifier, image, firstPatch, step, alpha, variances, confidences, scratch);
     }
 
     float
     BaseClassifier::getValue(ImageRepresentation *image, Rect ROI, int weakClassifierIdx)
     {
       if (weakClassifierIdx < 0 || weakClassifierIdx >= m_numWeakClassifier)
-        return weakClassifier[m_selectedClassifier]->getValue(image, ROI);
-      return weakClassifier[weakClassifierIdx]->getValue(image, ROI);
+        return weakClassifier->getValue(m_selectedClassifier, image, ROI);
+      return weakClassifier->getValue(weakClassifierIdx, image, ROI);
     }
 
     void
-    BaseClassifier::trainClassifier(ImageRepresentation* image, Rect ROI, int target, float importance, bool* errorMask)
+    BaseClassifier::prepareBatch(ImageRepresentation* image, const std::vector<Rect> & ROIs)
+    {
+      if (!m_referenceWeakClassifier)
+        weakClassifier->prepareBatch(image, ROIs);
+    }
+
+    void
+    BaseClassifier::clearBatch()
+    {
+      if (!m_referenceWeakClassifier)
+        weakClassifier->clearBatch();
+    }
+
+    void
+    BaseClassifier::trainClassifier(ImageRepresentation* image, Rect ROI, int target, float importance, bool* errorMask,
+                                    int batchSample)
     {
       //get poisson value
       double A = 1;
@@ -1431,16 +2527,15 @@ namespace cv
       int K_max = 10;
       while (1)
       {
-        double U_k = (double) rand() / RAND_MAX;
+        double U_k = weakClassifier->getRNG().uniform(0.0, 1.0);
         A *= U_k;
         if (K > K_max || A < exp(-importance))
           break;
         K++;
       }
 
-      for (int curK = 0; curK <= K; curK++)
-        for (int curWeakClassifier = 0; curWeakClassifier < m_numWeakClassifier + m_iterationInit; curWeakClassifier++)
-          errorMask[curWeakClassifier] = weakClassifier[curWeakClassifier]->update(image, ROI, target);
+      // the K+1 updates of a weak classifier are done at once, the feature is evaluated only once for them
+      weakClassifier->update(image, ROI, target, K + 1, errorMask, batchSample);
 
     }
 
@@ -1448,7 +2543,7 @@ namespace cv
     BaseClassifier::getErrorMask(ImageRepresentation* image, Rect ROI, int target, bool* errorMask)
     {
       for (int curWeakClassifier = 0; curWeakClassifier < m_numWeakClassifier + m_iterationInit; curWeakClassifier++)
-        errorMask[curWeakClassifier] = (weakClassifier[curWeakClassifier]->eval(image, ROI) != target);
+        errorMask[curWeakClassifier] = (weakClassifier->eval(curWeakClassifier, image, ROI) != target);
     }
 
     float
@@ -1548,15 +2643,12 @@ namespace cv
 
       if (maxError > errors[m_idxOfNewWeakClassifier])
       {
-        delete weakClassifier[index];
-        weakClassifier[index] = weakClassifier[m_idxOfNewWeakClassifier];
+        weakClassifier->replace(index, m_idxOfNewWeakClassifier, patchSize);
         m_wWrong[index] = m_wWrong[m_idxOfNewWeakClassifier];
         m_wWrong[m_idxOfNewWeakClassifier] = 1;
         m_wCorrect[index] = m_wCorrect[m_idxOfNewWeakClassifier];
         m_wCorrect[m_idxOfNewWeakClassifier] = 1;
 
-        weakClassifier[m_idxOfNewWeakClassifier] = new WeakClassifierHaarFeature(patchSize);
-
         return index;
       }
       else
@@ -1581,7 +2673,9 @@ namespace cv
     StrongClassifier::StrongClassifier(int numBaseClassifier, int numWeakClassifier, Size patchSize,
                                        bool useFeatureExchange, int iterationInit)
         :
-          baseClassifier(0)
+          baseClassifier(0),
+          m_useRejectionThresholds(false),
+          m_nextPositiveVotes(0)
     {
       this->numBaseClassifier = numBaseClassifier;
       this->numAllWeakClassifier = numWeakClassifier + iterationInit;
@@ -1618,6 +2712,136 @@ namespace cv
       return value;
     }
 
+    void
+    StrongClassifier::prepareScales(const std::vector<Size> & patchSizes, int integralStep)
+    {
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->prepareScales(patchSizes, integralStep);
+    }
+
+    float
+    StrongClassifier::eval(const ImageRepresentation *image, Rect ROI, EvalScratch & scratch) const
+    {
+      // the variance is computed once for all features of the patch
+      float variance = image->getUseVariance() ? image->computeVariance(ROI) : 1.0f;
+
+      float value = 0.0f;
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        value += baseClassifier[curBaseClassifier]->eval(image, ROI, variance, scratch) * alpha[curBaseClassifier];
+
+      return value;
+    }
+
+    void
+    StrongClassifier::evalGrid(const ImageRepresentation *image, Rect firstPatch, Size step,
+                               const cv::Mat_<float>* variances, cv::Mat_<float> & confidences,
+                               EvalScratch & scratch) const
+    {
+      // every cell sums up the votes in the same order as eval does
+      confidences = 0.0f;
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->evalGrid(image, firstPatch, step, alpha[curBaseClassifier], variances,
+                                                    confidences, scratch);
+    }
+
+    void
+    StrongClassifier::prepareCascade()
+    {
+      // stable sort by descending alpha, so stages with the same alpha keep the order of eval
+      m_cascadeOrder.resize(numBaseClassifier);
+      for (int curStage = 0; curStage < numBaseClassifier; curStage++)
+      {
+        int pos = curStage;
+        while (pos > 0 && alpha[m_cascadeOrder[pos - 1]] < alpha[curStage])
+        {
+          m_cascadeOrder[pos] = m_cascadeOrder[pos - 1];
+          pos--;
+        }
+        m_cascadeOrder[pos] = curStage;
+      }
+
+      // every stage votes +alpha or -alpha, or not at all for invalid features
+      m_cascadeRemaining.resize(numBaseClassifier + 1);
+      m_cascadeRemaining[numBaseClassifier] = 0.0f;
+      for (int curStage = numBaseClassifier - 1; curStage >= 0; curStage--)
+        m_cascadeRemaining[curStage] = m_cascadeRemaining[curStage + 1] + alpha[m_cascadeOrder[curStage]];
+
+      // the most the remaining stages took away from the recent positive samples with the current alphas, a
+      // patch which is further below the margin is not expected to get above it anymore
+      m_rejectionThresholds.assign(numBaseClassifier, -FLT_MAX);
+      if (!m_useRejectionThresholds || m_positiveVotes.empty())
+        return;
+
+      m_rejectionThresholds.assign(numBaseClassifier, 0.0f);
+      for (size_t curSample = 0; curSample < m_positiveVotes.size(); curSample++)
+      {
+        float value = 0.0f;
+        for (int curStage = numBaseClassifier - 1; curStage > 0; curStage--)
+        {
+          int curBaseClassifier = m_cascadeOrder[curStage];
+          value -= m_positiveVotes[curSample][curBaseClassifier] * alpha[curBaseClassifier];
+          m_rejectionThresholds[curStage - 1] = std::min(m_rejectionThresholds[curStage - 1], value);
+        }
+      }
+    }
+
+    float
+    StrongClassifier::evalCascade(const ImageRepresentation *image, Rect ROI, float minMargin, float maxConfidence,
+                                  EvalScratch & scratch) const
+    {
+      float variance = image->getUseVariance() ? image->computeVariance(ROI) : 1.0f;
+
+      float value = 0.0f;
+      for (int curStage = 0; curStage < numBaseClassifier; curStage++)
+      {
+        int curBaseClassifier = m_cascadeOrder[curStage];
+        value += baseClassifier[curBaseClassifier]->eval(image, ROI, variance, scratch) * alpha[curBaseClassifier];
+
+        float remaining = m_cascadeRemaining[curStage + 1];
+        if (value + remaining <= minMargin || value < minMargin + m_rejectionThresholds[curStage])
+          return std::min(value + remaining, minMargin);
+        if (value - remaining > minMargin && value + remaining < maxConfidence)
+          return value - remaining;
+      }
+
+      return value;
+    }
+
+    void
+    StrongClassifier::evalGridStage(const ImageRepresentation *image, int stage, Rect firstPatch, Size step,
+                                    const cv::Mat_<float>* variances, cv::Mat_<float> & confidences,
+                                    EvalScratch & scratch) const
+    {
+      int curBaseClassifier = m_cascadeOrder[stage];
+      baseClassifier[curBaseClassifier]->evalGrid(image, firstPatch, step, alpha[curBaseClassifier], variances,
+                                                  confidences, scratch);
+    }
+
+    void
+    StrongClassifier::setUseRejectionThresholds(bool useRejectionThresholds)
+    {
+      m_useRejectionThresholds = useRejectionThresholds;
+      if (!useRejectionThresholds)
+      {
+        m_positiveVotes.clear();
+        m_nextPositiveVotes = 0;
+      }
+    }
+
+    void
+    StrongClassifier::addPositiveVotes(ImageRepresentation *image, Rect ROI, int batchSample)
+    {
+      // ring buffer of the last positive samples
+      if (static_cast<int>(m_positiveVotes.size()) < NUM_POSITIVE_VOTES)
+        m_positiveVotes.push_back(std::vector<int>(numBaseClassifier));
+      std::vector<int> & votes = m_positiveVotes[m_nextPositiveVotes];
+      m_nextPositiveVotes = (m_nextPositiveVotes + 1) % NUM_POSITIVE_VOTES;
+
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        votes[curBaseClassifier] = (batchSample >= 0) ? baseClassifier[curBaseClassifier]->evalBatchSample(batchSample)
+            : baseClassifier[curBaseClassifier]->eval(image, ROI);
+    }
+
     bool
     StrongClassifier::update(ImageRepresentation *image, Rect ROI, int target, float importance)
     {
@@ -1632,6 +2856,30 @@ namespace cv
       return false;
     }
 
+    bool
+    StrongClassifier::updateSample(ImageRepresentation *image, Rect ROI, int target, float importance, int batchSample)
+    {
+      return update(image, ROI, target, importance);
+    }
+
+    void
+    StrongClassifier::updateBatch(ImageRepresentation *image, const std::vector<TrainingSample> & samples)
+    {
+      std::vector<Rect> ROIs(samples.size());
+      for (size_t curSample = 0; curSample < samples.size(); curSample++)
+        ROIs[curSample] = samples[curSample].ROI;
+
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->prepareBatch(image, ROIs);
+
+      for (size_t curSample = 0; curSample < samples.size(); curSample++)
+        updateSample(image, samples[curSample].ROI, samples[curSample].target, samples[curSample].importance,
+                     static_cast<int>(curSample));
+
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->clearBatch();
+    }
+
     float
     StrongClassifier::getSumAlpha(int toBaseClassifier)
     {
@@ -1680,15 +2928,60 @@ namespace cv
       }
     }
 
+    void
+    StrongClassifier::write(std::ostream & os) const
+    {
+      writeInt(os, numBaseClassifier);
+      writeFloats(os, alpha);
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->write(os);
+
+      int header[2] = { static_cast<int>(m_positiveVotes.size()), m_nextPositiveVotes };
+      writeValues(os, header, 2);
+      for (size_t curVotes = 0; curVotes < m_positiveVotes.size(); curVotes++)
+        writeValues(os, &m_positiveVotes[curVotes][0], numBaseClassifier);
+    }
+
+    bool
+    StrongClassifier::read(std::istream & is)
+    {
+      int storedNumBaseClassifier;
+      if (!readInt(is, storedNumBaseClassifier) || storedNumBaseClassifier != numBaseClassifier)
+        return false;
+      if (!readFloats(is, alpha))
+        return false;
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+      {
+        if (!baseClassifier[curBaseClassifier]->read(is))
+          return false;
+      }
+
+      int header[2];
+      if (!readValues(is, header, 2) || header[0] < 0 || header[0] > NUM_POSITIVE_VOTES || header[1] < 0
+          || header[1] >= NUM_POSITIVE_VOTES)
+        return false;
+      m_positiveVotes.assign(header[0], std::vector<int>(numBaseClassifier));
+      m_nextPositiveVotes = header[1];
+      for (size_t curVotes = 0; curVotes < m_positiveVotes.size(); curVotes++)
+      {
+        if (!readValues(is, &m_positiveVotes[curVotes][0], numBaseClassifier))
+          return false;
+      }
+
+      // the cascade is prepared again by the detector
+      return true;
+    }
+
     StrongClassifierDirectSelection::StrongClassifierDirectSelection(int numBaseClassifier, int numWeakClassifier,
-                                                                     Size patchSize, bool useFeatureExchange,
-                                                                     int iterationInit)
+                                                                     Size patchSize, cv::RNG & rng,
+                                                                     bool useFeatureExchange, int iterationInit,
+                                                                     bool randomFeatures)
         :
           StrongClassifier(numBaseClassifier, numWeakClassifier, patchSize, useFeatureExchange, iterationInit)
     {
       this->useFeatureExchange = useFeatureExchange;
       baseClassifier = new BaseClassifier*[numBaseClassifier];
-      baseClassifier[0] = new BaseClassifier(numWeakClassifier, iterationInit, patchSize);
+      baseClassifier[0] = new BaseClassifier(numWeakClassifier, iterationInit, patchSize, rng, randomFeatures);
 
       for (int curBaseClassifier = 1; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
         baseClassifier[curBaseClassifier] = new BaseClassifier(numWeakClassifier, iterationInit,
@@ -1706,12 +2999,19 @@ namespace cv
 
     bool
     StrongClassifierDirectSelection::update(ImageRepresentation *image, Rect ROI, int target, float importance)
+    {
+      return updateSample(image, ROI, target, importance, -1);
+    }
+
+    bool
+    StrongClassifierDirectSelection::updateSample(ImageRepresentation *image, Rect ROI, int target, float importance,
+                                                  int batchSample)
     {
       memset(m_errorMask, 0, numAllWeakClassifier * sizeof(bool));
       m_errors.assign(numAllWeakClassifier, 0);
       m_sumErrors.assign(numAllWeakClassifier, 0);
 
-      baseClassifier[0]->trainClassifier(image, ROI, target, importance, m_errorMask);
+      baseClassifier[0]->trainClassifier(image, ROI, target, importance, m_errorMask, batchSample);
       for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
       {
         int selectedClassifier = baseClassifier[curBaseClassifier]->selectBestClassifier(m_errorMask, importance,
@@ -1751,11 +3051,15 @@ namespace cv
                 baseClassifier[0]->getIdxOfNewWeakClassifier(), replacedClassifier);
       }
 
+      if (target == 1 && m_useRejectionThresholds)
+        addPositiveVotes(image, ROI, batchSample);
+
       return true;
     }
 
     StrongClassifierStandard::StrongClassifierStandard(int numBaseClassifier, int numWeakClassifier, Size patchSize,
-                                                       bool useFeatureExchange, int iterationInit)
+                                                       cv::RNG & rng, bool useFeatureExchange, int iterationInit,
+                                                       bool randomFeatures)
         :
           StrongClassifier(numBaseClassifier, numWeakClassifier, patchSize, useFeatureExchange, iterationInit)
     {
@@ -1764,7 +3068,8 @@ namespace cv
 
       for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
       {
-        baseClassifier[curBaseClassifier] = new BaseClassifier(numWeakClassifier, iterationInit, patchSize);
+        baseClassifier[curBaseClassifier] = new BaseClassifier(numWeakClassifier, iterationInit, patchSize, rng,
+                                                               randomFeatures);
       }
 
       m_errorMask = new bool[numAllWeakClassifier];
@@ -1778,6 +3083,13 @@ namespace cv
 
     bool
     StrongClassifierStandard::update(ImageRepresentation *image, Rect ROI, int target, float importance)
+    {
+      return updateSample(image, ROI, target, importance, -1);
+    }
+
+    bool
+    StrongClassifierStandard::updateSample(ImageRepresentation *image, Rect ROI, int target, float importance,
+                                           int batchSample)
     {
       int curBaseClassifier;
       for (curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
@@ -1786,7 +3098,7 @@ namespace cv
         m_errors.assign(numAllWeakClassifier, 0);
 
         int selectedClassifier;
-        baseClassifier[curBaseClassifier]->trainClassifier(image, ROI, target, importance, m_errorMask);
+        baseClassifier[curBaseClassifier]->trainClassifier(image, ROI, target, importance, m_errorMask, batchSample);
         selectedClassifier = baseClassifier[curBaseClassifier]->selectBestClassifier(m_errorMask, importance, m_errors);
 
         if (m_errors[selectedClassifier] >= 0.5)
@@ -1807,14 +3119,19 @@ namespace cv
 
       }
 
+      if (target == 1 && m_useRejectionThresholds)
+        addPositiveVotes(image, ROI, batchSample);
+
       return true;
     }
 
     StrongClassifierStandardSemi::StrongClassifierStandardSemi(int numBaseClassifier, int numWeakClassifier,
-                                                               Size patchSize, bool useFeatureExchange,
-                                                               int iterationInit)
+                                                               Size patchSize, cv::RNG & rng,
+                                                               bool useFeatureExchange, int iterationInit,
+                                                               bool randomFeatures)
         :
-          StrongClassifier(numBaseClassifier, numWeakClassifier, patchSize, useFeatureExchange, iterationInit)
+          StrongClassifier(numBaseClassifier, numWeakClassifier, patchSize, useFeatureExchange, iterationInit),
+          m_batchPrepared(false)
     {
       // init Base Classifier
       baseClassifier = new BaseClassifier*[numBaseClassifier];
@@ -1824,7 +3141,8 @@ namespace cv
 
       for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
       {
-        baseClassifier[curBaseClassifier] = new BaseClassifier(numWeakClassifier, iterationInit, patchSize);
+        baseClassifier[curBaseClassifier] = new BaseClassifier(numWeakClassifier, iterationInit, patchSize, rng,
+                                                               randomFeatures);
       }
 
       m_errorMask = new bool[numAllWeakClassifier];
@@ -1838,6 +3156,41 @@ namespace cv
 
     bool
     StrongClassifierStandardSemi::updateSemi(ImageRepresentation *image, Rect ROI, float priorConfidence)
+    {
+      return updateSemiSample(image, ROI, priorConfidence, -1);
+    }
+
+    void
+    StrongClassifierStandardSemi::prepareSemiBatch(ImageRepresentation *image, const std::vector<Rect> & ROIs)
+    {
+      // every base classifier has a pool of its own, and the pools only read the image
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->prepareBatch(image, ROIs);
+
+      m_batchPrepared = true;
+    }
+
+    void
+    StrongClassifierStandardSemi::updateSemiBatch(ImageRepresentation *image, const std::vector<Rect> & ROIs,
+                                                  const std::vector<float> & priorConfidences)
+    {
+      if (!m_batchPrepared)
+        prepareSemiBatch(image, ROIs);
+
+      for (size_t curSample = 0; curSample < ROIs.size(); curSample++)
+        updateSemiSample(image, ROIs[curSample], priorConfidences[curSample], static_cast<int>(curSample));
+
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+        baseClassifier[curBaseClassifier]->clearBatch();
+      m_batchPrepared = false;
+    }
+
+    bool
+    StrongClassifierStandardSemi::updateSemiSample(ImageRepresentation *image, Rect ROI, float priorConfidence,
+                                                   int batchSample)
     {
 
       float value = 0.0f, kvalue = 0.0f;
@@ -1870,33 +3223,133 @@ namespace cv
           float myImportance = ::abs(combinedDecision);
           m_pseudoLambda[curBaseClassifier] = myImportance;
 
-          baseClassifier[curBaseClassifier]->trainClassifier(image, ROI, myTarget, myImportance, m_errorMask);
-          selectedClassifier = baseClassifier[curBaseClassifier]->selectBestClassifier(m_errorMask, myImportance,
-                                                                                       m_errors);
-        }
+          baseClassifier[curBaseClassifier]->trainClassifier(image, ROI, myTarget, myImportance, m_errorMask,
+                                                             batchSample);
+          selectedClassifier = baseClassifier[curBaseClassifier]->selectBestClassifier(m_errorMask, myImportance,
+                                                                                       m_errors);
+        }
+
+        int vote = (batchSample >= 0) ? baseClassifier[curBaseClassifier]->evalBatchSample(batchSample)
+            : baseClassifier[curBaseClassifier]->eval(image, ROI);
+        float curValue = vote * alpha[curBaseClassifier];
+        value += curValue;
+        sumAlpha += alpha[curBaseClassifier];
+
+        if (m_errors[selectedClassifier] >= 0.5)
+          alpha[curBaseClassifier] = 0;
+        else
+          alpha[curBaseClassifier] = logf((1.0f - m_errors[selectedClassifier]) / m_errors[selectedClassifier]);
+
+        if (useFeatureExchange)
+          baseClassifier[curBaseClassifier]->replaceWeakestClassifier(m_errors, patchSize);
+
+      }
+
+      // the samples the prior is sure about are the positives here
+      if (priorConfidence > 0 && m_useRejectionThresholds)
+        addPositiveVotes(image, ROI, batchSample);
+
+      return used;
+    }
+
+    FrozenClassifier::FrozenClassifier()
+        :
+          m_sumAlpha(0)
+    {
+    }
+
+    FrozenClassifier::FrozenClassifier(StrongClassifier* classifier)
+    {
+      int numBaseClassifier = classifier->getNumBaseClassifier();
+      m_sumAlpha = classifier->getSumAlpha();
+
+      // base classifiers without a weight do not change the confidence
+      for (int curBaseClassifier = 0; curBaseClassifier < numBaseClassifier; curBaseClassifier++)
+      {
+        float alpha = classifier->getAlpha(curBaseClassifier);
+        if (alpha == 0.0f)
+          continue;
+
+        const WeakClassifierPool* weakClassifier =
+            classifier->getBaseClassifier(curBaseClassifier)->getReferenceWeakClassifier();
+        int selected = classifier->getIdxOfSelectedClassifierOfBaseClassifier(curBaseClassifier);
+        m_features.push_back(weakClassifier->getFeature(selected));
+        m_thresholds.push_back(weakClassifier->getThreshold(selected));
+        m_parities.push_back(weakClassifier->getParity(selected));
+        m_alphas.push_back(alpha);
+      }
+    }
+
+    float
+    FrozenClassifier::eval(ImageRepresentation* image, Rect ROI)
+    {
+      float value = 0.0f;
+      for (size_t curFeature = 0; curFeature < m_features.size(); curFeature++)
+      {
+        float featureValue;
+        if (!m_features[curFeature].eval(image, ROI, &featureValue))
+          continue;
 
-        float curValue = baseClassifier[curBaseClassifier]->eval(image, ROI) * alpha[curBaseClassifier];
-        value += curValue;
-        sumAlpha += alpha[curBaseClassifier];
+        float vote = (m_parities[curFeature] * (featureValue - m_thresholds[curFeature]) > 0) ? 1.0f : -1.0f;
+        value += vote * m_alphas[curFeature];
+      }
 
-        if (m_errors[selectedClassifier] >= 0.5)
-          alpha[curBaseClassifier] = 0;
-        else
-          alpha[curBaseClassifier] = logf((1.0f - m_errors[selectedClassifier]) / m_errors[selectedClassifier]);
+      return value;
+    }
 
-        if (useFeatureExchange)
-          baseClassifier[curBaseClassifier]->replaceWeakestClassifier(m_errors, patchSize);
+    void
+    FrozenClassifier::write(std::ostream & os) const
+    {
+      writeInt(os, static_cast<int>(m_features.size()));
+      writeValues(os, &m_sumAlpha, 1);
+      for (size_t curFeature = 0; curFeature < m_features.size(); curFeature++)
+        m_features[curFeature].write(os);
+      writeFloats(os, m_thresholds);
+      writeFloats(os, m_parities);
+      writeFloats(os, m_alphas);
+    }
 
+    FrozenClassifier*
+    FrozenClassifier::read(std::istream & is)
+    {
+      int numFeatures;
+      float sumAlpha;
+      if (!readInt(is, numFeatures) || numFeatures < 0 || numFeatures > MAX_SNAPSHOT_BASE_CLASSIFIERS
+          || !readValues(is, &sumAlpha, 1))
+        return NULL;
+
+      // the features are read into copies of an empty one
+      FrozenClassifier* frozen = new FrozenClassifier();
+      frozen->m_sumAlpha = sumAlpha;
+      frozen->m_thresholds.resize(numFeatures);
+      frozen->m_parities.resize(numFeatures);
+      frozen->m_alphas.resize(numFeatures);
+      bool valid = true;
+      for (int curFeature = 0; curFeature < numFeatures && valid; curFeature++)
+      {
+        frozen->m_features.push_back(FeatureHaar());
+        valid = frozen->m_features.back().read(is);
       }
 
-      return used;
+      if (!valid || !readFloats(is, frozen->m_thresholds) || !readFloats(is, frozen->m_parities)
+          || !readFloats(is, frozen->m_alphas))
+      {
+        delete frozen;
+        return NULL;
+      }
+      return frozen;
     }
 
     Detector::Detector(StrongClassifier* classifier)
         :
-          m_sizeDetections(0)
+          m_sizeDetections(0),
+          m_earlyTermination(false),
+          m_coarseStep(0),
+          m_numCandidates(0),
+          m_numEvaluations(0)
     {
       this->m_classifier = classifier;
+      m_numThreads = 0;
 
       m_sizeConfidences = 0;
       m_maxConfidence = -FLT_MAX;
@@ -1908,6 +3361,31 @@ namespace cv
     {
     }
 
+    void
+    Detector::setNumThreads(int numThreads)
+    {
+      m_numThreads = std::max(numThreads, 0);
+    }
+
+    int
+    Detector::getNumThreads()
+    {
+      if (m_numThreads > 0)
+        return m_numThreads;
+#ifdef _OPENMP
+      return omp_get_max_threads();
+#else
+      return 1;
+#endif
+    }
+
+    void
+    Detector::setCoarseToFine(int coarseStep, int numCandidates)
+    {
+      m_coarseStep = coarseStep;
+      m_numCandidates = std::max(numCandidates, 1);
+    }
+
     void
     Detector::prepareConfidencesMemory(int numPatches)
     {
@@ -1933,17 +3411,53 @@ namespace cv
     {
       int numPatches = patches->getNum();
 
+      // scale the features to all patch sizes of the scan at once, instead of switching sizes patch by patch, this
+      // also has to be done before the threads share the classifier. The patch sets are rebuilt every frame, so
+      // they are told apart by their sizes.
+      std::vector<Size> patchSizes = patches->getPatchSizes();
+      if (patchSizes != m_patchSizes)
+        m_patchSizes.swap(patchSizes);
+      m_classifier->prepareScales(m_patchSizes, image->getIntegralStep());
+
       prepareConfidencesMemory(numPatches);
+      m_numEvaluations = numPatches;
 
       m_numDetections = 0;
       m_idxBestDetection = -1;
       m_maxConfidence = -FLT_MAX;
       int numBaseClassifiers = m_classifier->getNumBaseClassifier();
+      if (m_earlyTermination)
+        m_classifier->prepareCascade();
 
-      for (int curPatch = 0; curPatch < numPatches; curPatch++)
+      int numThreads = getNumThreads();
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
       {
-        m_confidences[curPatch] = m_classifier->eval(image, patches->getRect(curPatch));
+        EvalScratch scratch;
+        // lower bound of the best confidence found by this thread, patches which stay below it need not be exact
+        float bestLower = -FLT_MAX;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+        for (int curPatch = 0; curPatch < numPatches; curPatch++)
+        {
+          if (!m_earlyTermination)
+          {
+            m_confidences[curPatch] = m_classifier->eval(image, patches->getRect(curPatch), scratch);
+            continue;
+          }
+
+          float confidence = m_classifier->evalCascade(image, patches->getRect(curPatch), minMargin, bestLower,
+                                                       scratch);
+          if (confidence > minMargin)
+            bestLower = std::max(bestLower, confidence);
+          m_confidences[curPatch] = confidence;
+        }
+      }
 
+      for (int curPatch = 0; curPatch < numPatches; curPatch++)
+      {
         if (m_confidences[curPatch] > m_maxConfidence)
         {
           m_maxConfidence = m_confidences[curPatch];
@@ -1984,24 +3498,48 @@ namespace cv
         m_confImageDisplay.create(patchGrid.height, patchGrid.width);
       }
 
-      int curPatch = 0;
-      // Eval and filter
-      for (int row = 0; row < patchGrid.height; row++)
+      // Eval the whole grid at once and filter, the grid is split up into bands of rows for the threads. The
+      // classifier and the variances are set up for the patches beforehand, as the threads only read them.
+      Rect firstPatch = patches->getRect(0);
+      Size patchStep = regPatches->getPatchStep();
+      m_classifier->prepareScales(std::vector<Size>(1, firstPatch.size()), image->getIntegralStep());
+      const cv::Mat_<float>* variances = NULL;
+      if (image->getUseVariance())
+        variances = &image->getVarianceMap(firstPatch, patchStep, patchGrid);
+
+      m_numEvaluations = numPatches;
+      if (m_coarseStep > 1)
+        evalGridCoarseToFine(image, firstPatch, patchStep, variances, minMargin);
+      else if (m_earlyTermination)
+        evalGridCascade(image, firstPatch, patchStep, variances, minMargin);
+      else
       {
-        for (int col = 0; col < patchGrid.width; col++)
+        int numThreads = getNumThreads();
+        int numBands = std::min(patchGrid.height, 4 * numThreads);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(numThreads) schedule(dynamic)
+#endif
+        for (int curBand = 0; curBand < numBands; curBand++)
         {
-          //int returnedInLayer;
-          m_confidences[curPatch] = m_classifier->eval(image, patches->getRect(curPatch));
-
-          // fill matrix
-          m_confMatrix(row, col) = m_confidences[curPatch];
-          curPatch++;
+          int startRow = curBand * patchGrid.height / numBands;
+          int endRow = (curBand + 1) * patchGrid.height / numBands;
+
+          EvalScratch scratch;
+          cv::Mat_<float> bandConfidences = m_confMatrix.rowRange(startRow, endRow);
+          cv::Mat_<float> bandVariances;
+          if (variances != NULL)
+            bandVariances = variances->rowRange(startRow, endRow);
+
+          Rect bandPatch = firstPatch;
+          bandPatch.y += startRow * patchStep.height;
+          m_classifier->evalGrid(image, bandPatch, patchStep, variances != NULL ? &bandVariances : NULL,
+                                 bandConfidences, scratch);
         }
-      }
 
-      // Filter
-      //cv::GaussianBlur(m_confMatrix,m_confMatrixSmooth,cv::Size(3,3),0.8);
-      cv::GaussianBlur(m_confMatrix, m_confMatrixSmooth, cv::Size(3, 3), 0);
+        // Filter
+        //cv::GaussianBlur(m_confMatrix,m_confMatrixSmooth,cv::Size(3,3),0.8);
+        cv::GaussianBlur(m_confMatrix, m_confMatrixSmooth, cv::Size(3, 3), 0);
+      }
 
       // Make display friendly
       double min_val, max_val;
@@ -2017,7 +3555,7 @@ namespace cv
       }
 
       // Get best detection
-      curPatch = 0;
+      int curPatch = 0;
       for (int row = 0; row < patchGrid.height; row++)
       {
         for (int col = 0; col < patchGrid.width; col++)
@@ -2047,6 +3585,242 @@ namespace cv
       }
     }
 
+    void
+    Detector::evalGridCascade(const ImageRepresentation* image, Rect firstPatch, Size step,
+                              const cv::Mat_<float>* variances, float minMargin)
+    {
+      // The stages are added to the grid in blocks. As every stage votes at most its alpha and the filter weights
+      // sum up to one, the smoothed confidences are known up to the remaining alphas after each block. Patches
+      // which are rejected for sure, or are detections which can not be the best one, are decided then, and only
+      // the patches needed to smooth the undecided ones are evaluated further.
+      m_classifier->prepareCascade();
+      int numStages = m_classifier->getNumBaseClassifier();
+      int rows = m_confMatrix.rows;
+      int cols = m_confMatrix.cols;
+
+      m_undecided.create(rows, cols);
+      m_needed.create(rows, cols);
+      m_decidedConfidences.create(rows, cols);
+      m_confMatrix = 0.0f;
+      m_undecided = 1;
+      m_needed = 1;
+      float bestLower = -FLT_MAX;
+
+      int numThreads = getNumThreads();
+      for (int startStage = 0; startStage < numStages; startStage += CASCADE_CHECK_STAGES)
+      {
+        int endStage = std::min(startStage + CASCADE_CHECK_STAGES, numStages);
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+        {
+          EvalScratch scratch;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+          for (int row = 0; row < rows; row++)
+          {
+            // the needed patches of a row are evaluated as one run
+            const unsigned char* pNeeded = m_needed[row];
+            int startCol = 0;
+            while (startCol < cols && !pNeeded[startCol])
+              startCol++;
+            if (startCol == cols)
+              continue;
+            int endCol = cols;
+            while (!pNeeded[endCol - 1])
+              endCol--;
+
+            Rect run(startCol, row, endCol - startCol, 1);
+            cv::Mat_<float> runConfidences = m_confMatrix(run);
+            cv::Mat_<float> runVariances;
+            if (variances != NULL)
+              runVariances = (*variances)(run);
+
+            Rect runPatch = firstPatch;
+            runPatch.x += startCol * step.width;
+            runPatch.y += row * step.height;
+            for (int curStage = startStage; curStage < endStage; curStage++)
+              m_classifier->evalGridStage(image, curStage, runPatch, step, variances != NULL ? &runVariances : NULL,
+                                          runConfidences, scratch);
+          }
+        }
+
+        cv::GaussianBlur(m_confMatrix, m_confMatrixSmooth, cv::Size(3, 3), 0);
+        if (endStage == numStages)
+          break;
+
+        // the rejection thresholds are learned on single patches, they are applied to the smoothed ones as well
+        float remaining = m_classifier->getCascadeRemaining(endStage);
+        float threshold = minMargin + m_classifier->getRejectionThreshold(endStage - 1);
+
+        for (int row = 0; row < rows; row++)
+          for (int col = 0; col < cols; col++)
+            if (m_undecided(row, col))
+              bestLower = std::max(bestLower, m_confMatrixSmooth(row, col) - remaining);
+
+        int numUndecided = 0;
+        for (int row = 0; row < rows; row++)
+        {
+          for (int col = 0; col < cols; col++)
+          {
+            if (!m_undecided(row, col))
+              continue;
+
+            float value = m_confMatrixSmooth(row, col);
+            if (value + remaining <= minMargin || value < threshold)
+            {
+              m_decidedConfidences(row, col) = std::min(value + remaining, minMargin);
+              m_undecided(row, col) = 0;
+            }
+            else if (value - remaining > minMargin && value + remaining < bestLower)
+            {
+              m_decidedConfidences(row, col) = value - remaining;
+              m_undecided(row, col) = 0;
+            }
+            else
+              numUndecided++;
+          }
+        }
+
+        if (numUndecided == 0)
+          break;
+
+        // the 3x3 filter needs the neighbours of the undecided patches
+        cv::dilate(m_undecided, m_needed, cv::Mat());
+      }
+
+      // the undecided patches are exact now, the others get their bounds
+      for (int row = 0; row < rows; row++)
+        for (int col = 0; col < cols; col++)
+          if (!m_undecided(row, col))
+            m_confMatrixSmooth(row, col) = m_decidedConfidences(row, col);
+    }
+
+    void
+    Detector::evalGridCoarseToFine(const ImageRepresentation* image, Rect firstPatch, Size step,
+                                   const cv::Mat_<float>* variances, float minMargin)
+    {
+      // The grid is evaluated at every m_coarseStep-th patch first. Around the best of these patches the grid is
+      // evaluated up to the neighbouring coarse patches and smoothed just like in the full search, so the search
+      // finds the same best detection as long as it lies next to one of the candidates. The other patches are
+      // not evaluated and are put below the margin.
+      int rows = m_confMatrix.rows;
+      int cols = m_confMatrix.cols;
+      int coarseRows = (rows - 1) / m_coarseStep + 1;
+      int coarseCols = (cols - 1) / m_coarseStep + 1;
+      Size coarseStep(step.width * m_coarseStep, step.height * m_coarseStep);
+
+      m_coarseConfidences.create(coarseRows, coarseCols);
+      if (variances != NULL)
+      {
+        m_coarseVariances.create(coarseRows, coarseCols);
+        for (int row = 0; row < coarseRows; row++)
+          for (int col = 0; col < coarseCols; col++)
+            m_coarseVariances(row, col) = (*variances)(row * m_coarseStep, col * m_coarseStep);
+      }
+
+      int numThreads = getNumThreads();
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+      {
+        EvalScratch scratch;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (int row = 0; row < coarseRows; row++)
+        {
+          cv::Mat_<float> rowConfidences = m_coarseConfidences.row(row);
+          cv::Mat_<float> rowVariances;
+          if (variances != NULL)
+            rowVariances = m_coarseVariances.row(row);
+
+          Rect rowPatch = firstPatch;
+          rowPatch.y += row * coarseStep.height;
+          m_classifier->evalGrid(image, rowPatch, coarseStep, variances != NULL ? &rowVariances : NULL,
+                                 rowConfidences, scratch);
+        }
+      }
+
+      // the candidates are the best coarse patches, the first one of equal patches wins
+      int numCoarse = coarseRows * coarseCols;
+      int numCandidates = std::min(m_numCandidates, numCoarse);
+      m_coarseOrder.resize(numCoarse);
+      for (int curCoarse = 0; curCoarse < numCoarse; curCoarse++)
+        m_coarseOrder[curCoarse] = std::make_pair(-m_coarseConfidences(curCoarse / coarseCols, curCoarse % coarseCols),
+                                                  curCoarse);
+      std::partial_sort(m_coarseOrder.begin(), m_coarseOrder.begin() + numCandidates, m_coarseOrder.end());
+
+      m_undecided.create(rows, cols);
+      m_undecided = 0;
+      for (int curCandidate = 0; curCandidate < numCandidates; curCandidate++)
+      {
+        int row = (m_coarseOrder[curCandidate].second / coarseCols) * m_coarseStep;
+        int col = (m_coarseOrder[curCandidate].second % coarseCols) * m_coarseStep;
+        int startRow = std::max(row - m_coarseStep + 1, 0);
+        int startCol = std::max(col - m_coarseStep + 1, 0);
+        Rect window(startCol, startRow, std::min(col + m_coarseStep, cols) - startCol,
+                    std::min(row + m_coarseStep, rows) - startRow);
+        m_undecided(window).setTo(1);
+      }
+
+      // the 3x3 filter needs the neighbours of the refined patches
+      cv::dilate(m_undecided, m_needed, cv::Mat());
+      m_confMatrix = 0.0f;
+      int numEvaluations = numCoarse;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads) reduction(+:numEvaluations)
+#endif
+      {
+        EvalScratch scratch;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (int row = 0; row < rows; row++)
+        {
+          // the needed patches of a row are evaluated as one run
+          const unsigned char* pNeeded = m_needed[row];
+          int startCol = 0;
+          while (startCol < cols && !pNeeded[startCol])
+            startCol++;
+          if (startCol == cols)
+            continue;
+          int endCol = cols;
+          while (!pNeeded[endCol - 1])
+            endCol--;
+
+          Rect run(startCol, row, endCol - startCol, 1);
+          cv::Mat_<float> runConfidences = m_confMatrix(run);
+          cv::Mat_<float> runVariances;
+          if (variances != NULL)
+            runVariances = (*variances)(run);
+
+          Rect runPatch = firstPatch;
+          runPatch.x += startCol * step.width;
+          runPatch.y += row * step.height;
+          m_classifier->evalGrid(image, runPatch, step, variances != NULL ? &runVariances : NULL, runConfidences,
+                                 scratch);
+          numEvaluations += run.width;
+        }
+      }
+      m_numEvaluations = numEvaluations;
+
+      cv::GaussianBlur(m_confMatrix, m_confMatrixSmooth, cv::Size(3, 3), 0);
+
+      float lowest = minMargin;
+      for (int row = 0; row < rows; row++)
+        for (int col = 0; col < cols; col++)
+          if (m_undecided(row, col))
+            lowest = std::min(lowest, m_confMatrixSmooth(row, col));
+      for (int row = 0; row < rows; row++)
+        for (int col = 0; col < cols; col++)
+          if (!m_undecided(row, col))
+            m_confMatrixSmooth(row, col) = lowest;
+    }
+
     int
     Detector::getNumDetections()
     {
@@ -2077,45 +3851,197 @@ namespace cv
       return m_idxDetections[detectionIdx];
     }
 
-    BoostingTracker::BoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI, int numBaseClassifier)
+    MotionModel::MotionModel()
     {
-      int numWeakClassifier = numBaseClassifier * 10;
-      bool useFeatureExchange = true;
-      int iterationInit = 50;
-      cv::Size patchSize(initPatch.width, initPatch.height);
+      init(Point2f(0.0f, 0.0f));
+    }
 
-      this->validROI = validROI;
+    void
+    MotionModel::init(Point2f center)
+    {
+      m_position[0] = center.x;
+      m_position[1] = center.y;
+      for (int axis = 0; axis < 2; axis++)
+      {
+        m_velocity[axis] = 0.0f;
+        m_varPosition[axis] = MOTION_NOISE_MEASUREMENT;
+        m_covariance[axis] = 0.0f;
+        m_varVelocity[axis] = MOTION_INIT_VAR_VELOCITY;
+      }
+    }
+
+    void
+    MotionModel::predict()
+    {
+      for (int axis = 0; axis < 2; axis++)
+      {
+        m_position[axis] += m_velocity[axis];
+        m_varPosition[axis] += 2.0f * m_covariance[axis] + m_varVelocity[axis] + MOTION_NOISE_POSITION;
+        m_covariance[axis] += m_varVelocity[axis];
+        m_varVelocity[axis] += MOTION_NOISE_VELOCITY;
+      }
+    }
+
+    void
+    MotionModel::correct(Point2f center, float confidence)
+    {
+      // with a low confidence the measurement hardly changes the prediction, and the uncertainty keeps growing
+      float noise = MOTION_NOISE_MEASUREMENT / std::max(confidence, MOTION_MIN_CONFIDENCE);
+      float measured[2] = { center.x, center.y };
+      for (int axis = 0; axis < 2; axis++)
+      {
+        float gainPosition = m_varPosition[axis] / (m_varPosition[axis] + noise);
+        float gainVelocity = m_covariance[axis] / (m_varPosition[axis] + noise);
+        float innovation = measured[axis] - m_position[axis];
+
+        m_position[axis] += gainPosition * innovation;
+        m_velocity[axis] += gainVelocity * innovation;
+        m_varVelocity[axis] -= gainVelocity * m_covariance[axis];
+        m_varPosition[axis] *= 1.0f - gainPosition;
+        m_covariance[axis] *= 1.0f - gainPosition;
+      }
+    }
 
-      classifier = new StrongClassifierDirectSelection(numBaseClassifier, numWeakClassifier, patchSize,
-                                                       useFeatureExchange, iterationInit);
+    Rect
+    MotionModel::getSearchRegion(Size patchSize, float maxFactor, Rect validROI) const
+    {
+      int patchLength[2] = { patchSize.width, patchSize.height };
+      int validStart[2] = { validROI.x, validROI.y };
+      int validLength[2] = { validROI.width, validROI.height };
+      int start[2];
+      int length[2];
+      for (int axis = 0; axis < 2; axis++)
+      {
+        int maxMargin = std::max((int) ((maxFactor - 1.0f) * patchLength[axis] / 2), MOTION_MIN_MARGIN);
+        int margin = (int) ceil(MOTION_SIGMAS * sqrt(m_varPosition[axis])) + MOTION_MIN_MARGIN;
+        margin = std::min(margin, maxMargin);
+
+        // the region is moved inside validROI instead of being cut off
+        length[axis] = std::min(patchLength[axis] + 2 * margin, validLength[axis]);
+        start[axis] = (int) floor(m_position[axis] - 0.5f * length[axis] + 0.5f);
+        start[axis] = std::min(start[axis], validStart[axis] + validLength[axis] - length[axis]);
+        start[axis] = std::max(start[axis], validStart[axis]);
+      }
 
-      detector = new Detector(classifier);
+      return Rect(start[0], start[1], length[0], length[1]);
+    }
+
+    BoostingTracker::BoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI, int numBaseClassifier,
+                                     uint64 seed)
+        :
+          rng(seed),
+          useMotionModel(false)
+    {
+      this->validROI = validROI;
+
+      createClassifier(numBaseClassifier, initPatch.size(), true);
 
       trackedPatch = initPatch;
       Rect trackingROI = getTrackingROI(2.0f);
       cv::Size trackedPatchSize(trackedPatch.width, trackedPatch.height);
-      Patches* trackingPatches = new PatchesRegularScan(trackingROI, validROI, trackedPatchSize, 0.99f);
+      PatchesRegularScan trackingPatches(trackingROI, validROI, trackedPatchSize, 0.99f);
 
-      iterationInit = 50;
+      // all init steps learn the same five patches, so they are learned as one batch
+      int iterationInit = 50;
+      std::vector<TrainingSample> samples;
+      samples.reserve(8 * iterationInit);
       for (int curInitStep = 0; curInitStep < iterationInit; curInitStep++)
       {
-        std::cout << "\rinit tracker... " << int(((float) curInitStep) / (iterationInit - 1) * 100) << " %%";
-
-        classifier->update(image, trackingPatches->getSpecialRect("UpperLeft"), -1);
-        classifier->update(image, trackedPatch, 1);
-        classifier->update(image, trackingPatches->getSpecialRect("UpperRight"), -1);
-        classifier->update(image, trackedPatch, 1);
-        classifier->update(image, trackingPatches->getSpecialRect("LowerLeft"), -1);
-        classifier->update(image, trackedPatch, 1);
-        classifier->update(image, trackingPatches->getSpecialRect("LowerRight"), -1);
-        classifier->update(image, trackedPatch, 1);
+        samples.push_back(TrainingSample(trackingPatches.getSpecialRect(Patches::UPPER_LEFT), -1));
+        samples.push_back(TrainingSample(trackedPatch, 1));
+        samples.push_back(TrainingSample(trackingPatches.getSpecialRect(Patches::UPPER_RIGHT), -1));
+        samples.push_back(TrainingSample(trackedPatch, 1));
+        samples.push_back(TrainingSample(trackingPatches.getSpecialRect(Patches::LOWER_LEFT), -1));
+        samples.push_back(TrainingSample(trackedPatch, 1));
+        samples.push_back(TrainingSample(trackingPatches.getSpecialRect(Patches::LOWER_RIGHT), -1));
+        samples.push_back(TrainingSample(trackedPatch, 1));
       }
+      std::cout << "init tracker...";
+      classifier->updateBatch(image, samples);
+      std::cout << " done." << std::endl;
 
       confidence = -1;
-      delete trackingPatches;
 
     }
 
+    BoostingTracker::BoostingTracker()
+        :
+          classifier(NULL),
+          detector(NULL),
+          confidence(-1),
+          useMotionModel(false)
+    {
+    }
+
+    void
+    BoostingTracker::createClassifier(int numBaseClassifier, Size patchSize, bool randomFeatures)
+    {
+      int numWeakClassifier = numBaseClassifier * 10;
+      bool useFeatureExchange = true;
+      int iterationInit = 50;
+
+      classifier = new StrongClassifierDirectSelection(numBaseClassifier, numWeakClassifier, patchSize, rng,
+                                                       useFeatureExchange, iterationInit, randomFeatures);
+
+      detector = new Detector(classifier);
+    }
+
+    void
+    BoostingTracker::write(std::ostream & os) const
+    {
+      int header[4] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, classifier->getNumBaseClassifier() };
+      writeValues(os, header, 4);
+      writeValues(os, &rng.state, 1);
+      int patchSize[2] = { classifier->getPatchSize().width, classifier->getPatchSize().height };
+      writeValues(os, patchSize, 2);
+      writeRect(os, validROI);
+      writeRect(os, trackedPatch);
+      writeValues(os, &confidence, 1);
+      writeInt(os, 0); // in place of the prior confidence of the semi-supervised tracker
+      classifier->write(os);
+    }
+
+    BoostingTracker*
+    BoostingTracker::read(std::istream & is)
+    {
+      int header[4];
+      uint64 state;
+      int patchSize[2];
+      // the sizes are bounded before anything is allocated for them
+      if (!readValues(is, header, 4) || header[0] != SNAPSHOT_MAGIC || header[1] != SNAPSHOT_VERSION || header[2] != 0
+          || header[3] < 1 || header[3] > MAX_SNAPSHOT_BASE_CLASSIFIERS || !readValues(is, &state, 1)
+          || !readValues(is, patchSize, 2) || patchSize[0] < 1 || patchSize[0] > MAX_SNAPSHOT_PATCH_SIZE
+          || patchSize[1] < 1 || patchSize[1] > MAX_SNAPSHOT_PATCH_SIZE)
+        return NULL;
+
+      // the features are all read from the snapshot, so none are drawn for them
+      BoostingTracker* tracker = new BoostingTracker();
+      tracker->createClassifier(header[3], Size(patchSize[0], patchSize[1]), false);
+      int padding;
+      if (!readRect(is, tracker->validROI) || !readRect(is, tracker->trackedPatch)
+          || !readValues(is, &tracker->confidence, 1) || !readInt(is, padding) || !tracker->classifier->read(is))
+      {
+        delete tracker;
+        return NULL;
+      }
+
+      tracker->rng.state = state;
+      return tracker;
+    }
+
+    void
+    BoostingTracker::setEarlyTermination(bool earlyTermination, bool useRejectionThresholds)
+    {
+      detector->setEarlyTermination(earlyTermination);
+      classifier->setUseRejectionThresholds(earlyTermination && useRejectionThresholds);
+    }
+
+    void
+    BoostingTracker::setCoarseToFine(int coarseStep, int numCandidates)
+    {
+      detector->setCoarseToFine(coarseStep, numCandidates);
+    }
+
     BoostingTracker::~BoostingTracker(void)
     {
       delete detector;
@@ -2132,20 +4058,31 @@ namespace cv
       if (detector->getNumDetections() <= 0)
       {
         confidence = 0;
+        if (useMotionModel)
+          motion.predict();
         return false;
       }
 
       trackedPatch = patches->getRect(detector->getPatchIdxOfBestDetection());
       confidence = detector->getConfidenceOfBestDetection();
+      if (useMotionModel)
+      {
+        motion.correct(Point2f(trackedPatch.x + 0.5f * trackedPatch.width, trackedPatch.y + 0.5f * trackedPatch.height),
+                       getConfidence());
+        motion.predict();
+      }
 
-      classifier->update(image, patches->getSpecialRect("UpperLeft"), -1);
-      classifier->update(image, trackedPatch, 1);
-      classifier->update(image, patches->getSpecialRect("UpperRight"), -1);
-      classifier->update(image, trackedPatch, 1);
-      classifier->update(image, patches->getSpecialRect("UpperLeft"), -1);
-      classifier->update(image, trackedPatch, 1);
-      classifier->update(image, patches->getSpecialRect("LowerRight"), -1);
-      classifier->update(image, trackedPatch, 1);
+      std::vector<TrainingSample> samples;
+      samples.reserve(8);
+      samples.push_back(TrainingSample(getNegative(patches, Patches::UPPER_LEFT), -1));
+      samples.push_back(TrainingSample(trackedPatch, 1));
+      samples.push_back(TrainingSample(getNegative(patches, Patches::UPPER_RIGHT), -1));
+      samples.push_back(TrainingSample(trackedPatch, 1));
+      samples.push_back(TrainingSample(getNegative(patches, Patches::UPPER_LEFT), -1));
+      samples.push_back(TrainingSample(trackedPatch, 1));
+      samples.push_back(TrainingSample(getNegative(patches, Patches::LOWER_RIGHT), -1));
+      samples.push_back(TrainingSample(trackedPatch, 1));
+      classifier->updateBatch(image, samples);
 
       return true;
     }
@@ -2162,9 +4099,36 @@ namespace cv
       if (searchRegion.x + searchRegion.width > validROI.width)
         searchRegion.width = validROI.width - searchRegion.x;
 
+      if (!useMotionModel)
+      {
+        imageROI = searchRegion;
+        return searchRegion;
+      }
+
+      trainingROI = searchRegion;
+      searchRegion = motion.getSearchRegion(trackedPatch.size(), searchFactor, validROI);
+      imageROI = trainingROI | searchRegion;
       return searchRegion;
     }
 
+    void
+    BoostingTracker::setMotionModel(bool useMotionModel)
+    {
+      this->useMotionModel = useMotionModel;
+      motion.init(Point2f(trackedPatch.x + 0.5f * trackedPatch.width, trackedPatch.y + 0.5f * trackedPatch.height));
+      motion.predict();
+    }
+
+    Rect
+    BoostingTracker::getNegative(Patches* patches, Patches::SpecialRect corner)
+    {
+      // the search region of the motion model can be close around the patch, the negatives are taken from the
+      // corners of the fixed search region then
+      if (!useMotionModel)
+        return patches->getSpecialRect(corner);
+      return PatchesRegularScan(trainingROI, validROI, trackedPatch.size(), 0.99f).getSpecialRect(corner);
+    }
+
     float
     BoostingTracker::getConfidence()
     {
@@ -2187,66 +4151,162 @@ namespace cv
     }
 
     SemiBoostingTracker::SemiBoostingTracker(ImageRepresentation* image, Rect initPatch, Rect validROI,
-                                             int numBaseClassifier)
+                                             int numBaseClassifier, uint64 seed)
+        :
+          rng(seed),
+          useMotionModel(false)
     {
-      int numWeakClassifier = 100;
-      bool useFeatureExchange = true;
-      int iterationInit = 50;
-      Size patchSize(initPatch.width, initPatch.height);
-
       this->validROI = validROI;
 
       //	classifierOff = new StrongClassifierDirectSelection(numBaseClassifier, numBaseClassifier*10, patchSize, useFeatureExchange, iterationInit);
-      classifierOff = new StrongClassifierStandardSemi(numBaseClassifier, numWeakClassifier, patchSize,
-                                                       useFeatureExchange, iterationInit);
-      classifier = new StrongClassifierStandardSemi(numBaseClassifier, numWeakClassifier, patchSize, useFeatureExchange,
-                                                    iterationInit);
-
+      // the offline classifier has a generator of its own, so both classifiers can be trained at once
+      cv::RNG rngOff(rng.next());
+      cv::Ptr<StrongClassifierStandardSemi> classifierOff = createClassifier(numBaseClassifier, initPatch.size(),
+                                                                             rngOff, true);
+      classifier = createClassifier(numBaseClassifier, initPatch.size(), rng, true);
       detector = new Detector(classifier);
 
       trackedPatch = initPatch;
       Rect trackingROI = getTrackingROI(2.0f);
       Size trackedPatchSize(trackedPatch.width, trackedPatch.height);
-      Patches* trackingPatches = new PatchesRegularScan(trackingROI, validROI, trackedPatchSize, 0.99f);
+      PatchesRegularScan trackingPatches(trackingROI, validROI, trackedPatchSize, 0.99f);
 
-      iterationInit = 50;
+      // both classifiers learn the same five patches in every init step, so each learns them as one batch
+      int iterationInit = 50;
+      std::vector<Rect> ROIs, ROIsOff;
+      std::vector<float> priors, priorsOff;
       for (int curInitStep = 0; curInitStep < iterationInit; curInitStep++)
       {
-        std::cout << "\rinit tracker... " << int(((float) curInitStep) / (iterationInit - 1) * 100) << " %%";
-        classifier->updateSemi(image, trackingPatches->getSpecialRect("UpperLeft"), -1);
-        classifier->updateSemi(image, trackedPatch, 1);
-        classifier->updateSemi(image, trackingPatches->getSpecialRect("UpperRight"), -1);
-        classifier->updateSemi(image, trackedPatch, 1);
-        classifier->updateSemi(image, trackingPatches->getSpecialRect("LowerLeft"), -1);
-        classifier->updateSemi(image, trackedPatch, 1);
-        classifier->updateSemi(image, trackingPatches->getSpecialRect("LowerRight"), -1);
-        classifier->updateSemi(image, trackedPatch, 1);
+        Rect negatives[4] = { trackingPatches.getSpecialRect(Patches::UPPER_LEFT),
+                              trackingPatches.getSpecialRect(Patches::UPPER_RIGHT),
+                              trackingPatches.getSpecialRect(Patches::LOWER_LEFT),
+                              trackingPatches.getSpecialRect(Patches::LOWER_RIGHT) };
+        for (int curNegative = 0; curNegative < 4; curNegative++)
+        {
+          ROIs.push_back(negatives[curNegative]);
+          priors.push_back(-1);
+          ROIs.push_back(trackedPatch);
+          priors.push_back(1);
+
+          //one (first) shot learning
+          ROIsOff.push_back(trackedPatch);
+          priorsOff.push_back(1);
+          ROIsOff.push_back(negatives[curNegative]);
+          priorsOff.push_back(-1);
+        }
       }
-      std::cout << " done." << std::endl;
 
-      //one (first) shot learning
-      iterationInit = 50;
-      for (int curInitStep = 0; curInitStep < iterationInit; curInitStep++)
+      // the feature values of the batches are computed in parallel across the base classifiers first, then the
+      // two classifiers learn their samples at once; they only read the image while doing so
+      std::cout << "init tracker and prior...";
+      classifier->prepareSemiBatch(image, ROIs);
+      classifierOff->prepareSemiBatch(image, ROIsOff);
+#ifdef _OPENMP
+#pragma omp parallel sections
+#endif
       {
-        std::cout << "\rinit detector... " << int(((float) curInitStep) / (iterationInit - 1) * 100) << " %%";
-
-        classifierOff->updateSemi(image, trackedPatch, 1);
-        classifierOff->updateSemi(image, trackingPatches->getSpecialRect("UpperLeft"), -1);
-        classifierOff->updateSemi(image, trackedPatch, 1);
-        classifierOff->updateSemi(image, trackingPatches->getSpecialRect("UpperRight"), -1);
-        classifierOff->updateSemi(image, trackedPatch, 1);
-        classifierOff->updateSemi(image, trackingPatches->getSpecialRect("LowerLeft"), -1);
-        classifierOff->updateSemi(image, trackedPatch, 1);
-        classifierOff->updateSemi(image, trackingPatches->getSpecialRect("LowerRight"), -1);
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        classifier->updateSemiBatch(image, ROIs, priors);
+#ifdef _OPENMP
+#pragma omp section
+#endif
+        classifierOff->updateSemiBatch(image, ROIsOff, priorsOff);
       }
+      std::cout << " done." << std::endl;
 
-      delete trackingPatches;
+      // the offline classifier is not updated anymore, only its selected features are kept
+      prior = new FrozenClassifier(classifierOff);
 
       confidence = -1;
       priorConfidence = -1;
 
     }
 
+    SemiBoostingTracker::SemiBoostingTracker()
+        :
+          confidence(-1),
+          priorConfidence(-1),
+          useMotionModel(false)
+    {
+    }
+
+    StrongClassifierStandardSemi*
+    SemiBoostingTracker::createClassifier(int numBaseClassifier, Size patchSize, cv::RNG & rng, bool randomFeatures)
+    {
+      int numWeakClassifier = 100;
+      bool useFeatureExchange = true;
+      int iterationInit = 50;
+
+      return new StrongClassifierStandardSemi(numBaseClassifier, numWeakClassifier, patchSize, rng, useFeatureExchange,
+                                              iterationInit, randomFeatures);
+    }
+
+    void
+    SemiBoostingTracker::write(std::ostream & os) const
+    {
+      int header[4] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 1, classifier->getNumBaseClassifier() };
+      writeValues(os, header, 4);
+      writeValues(os, &rng.state, 1);
+      int patchSize[2] = { classifier->getPatchSize().width, classifier->getPatchSize().height };
+      writeValues(os, patchSize, 2);
+      writeRect(os, validROI);
+      writeRect(os, trackedPatch);
+      writeValues(os, &confidence, 1);
+      writeValues(os, &priorConfidence, 1);
+      prior->write(os);
+      classifier->write(os);
+    }
+
+    SemiBoostingTracker*
+    SemiBoostingTracker::read(std::istream & is)
+    {
+      int header[4];
+      uint64 state;
+      int patchSize[2];
+      // see BoostingTracker::read
+      if (!readValues(is, header, 4) || header[0] != SNAPSHOT_MAGIC || header[1] != SNAPSHOT_VERSION || header[2] != 1
+          || header[3] < 1 || header[3] > MAX_SNAPSHOT_BASE_CLASSIFIERS || !readValues(is, &state, 1)
+          || !readValues(is, patchSize, 2) || patchSize[0] < 1 || patchSize[0] > MAX_SNAPSHOT_PATCH_SIZE
+          || patchSize[1] < 1 || patchSize[1] > MAX_SNAPSHOT_PATCH_SIZE)
+        return NULL;
+
+      SemiBoostingTracker* tracker = new SemiBoostingTracker();
+      tracker->classifier = tracker->createClassifier(header[3], Size(patchSize[0], patchSize[1]), tracker->rng,
+                                                      false);
+      tracker->detector = new Detector(tracker->classifier);
+      if (!readRect(is, tracker->validROI) || !readRect(is, tracker->trackedPatch)
+          || !readValues(is, &tracker->confidence, 1) || !readValues(is, &tracker->priorConfidence, 1))
+      {
+        delete tracker;
+        return NULL;
+      }
+
+      tracker->prior = FrozenClassifier::read(is);
+      if (tracker->prior.empty() || !tracker->classifier->read(is))
+      {
+        delete tracker;
+        return NULL;
+      }
+
+      tracker->rng.state = state;
+      return tracker;
+    }
+
+    void
+    SemiBoostingTracker::setEarlyTermination(bool earlyTermination, bool useRejectionThresholds)
+    {
+      detector->setEarlyTermination(earlyTermination);
+      classifier->setUseRejectionThresholds(earlyTermination && useRejectionThresholds);
+    }
+
+    void
+    SemiBoostingTracker::setCoarseToFine(int coarseStep, int numCandidates)
+    {
+      detector->setCoarseToFine(coarseStep, numCandidates);
+    }
+
     bool
     SemiBoostingTracker::track(ImageRepresentation* image, Patches* patches)
     {
@@ -2258,11 +4318,19 @@ namespace cv
       {
         confidence = 0;
         priorConfidence = 0;
+        if (useMotionModel)
+          motion.predict();
         return false;
       }
 
       trackedPatch = patches->getRect(detector->getPatchIdxOfBestDetection());
       confidence = detector->getConfidenceOfBestDetection();
+      if (useMotionModel)
+      {
+        motion.correct(Point2f(trackedPatch.x + 0.5f * trackedPatch.width, trackedPatch.y + 0.5f * trackedPatch.height),
+                       getConfidence());
+        motion.predict();
+      }
 
       float off;
 
@@ -2271,7 +4339,7 @@ namespace cv
        Rect tmp;
        for (int curUpdate = 0; curUpdate < numUpdates; curUpdate++)
        {
-       tmp = patches->getSpecialRect ("Random");
+       tmp = patches->getSpecialRect (Patches::RANDOM);
        off = classifierOff->eval(image, tmp)/classifierOff->getSumAlpha();
        classifier->updateSemi (image, tmp, off);
 
@@ -2280,32 +4348,32 @@ namespace cv
 
        }*/
 
-      Rect tmp = patches->getSpecialRect("UpperLeft");
-      off = classifierOff->eval(image, tmp) / classifierOff->getSumAlpha();
+      Rect tmp = getNegative(patches, Patches::UPPER_LEFT);
+      off = prior->eval(image, tmp) / prior->getSumAlpha();
       classifier->updateSemi(image, tmp, off);
 
-      priorConfidence = classifierOff->eval(image, trackedPatch) / classifierOff->getSumAlpha();
+      priorConfidence = prior->eval(image, trackedPatch) / prior->getSumAlpha();
       classifier->updateSemi(image, trackedPatch, priorConfidence);
 
-      tmp = patches->getSpecialRect("LowerLeft");
-      off = classifierOff->eval(image, tmp) / classifierOff->getSumAlpha();
+      tmp = getNegative(patches, Patches::LOWER_LEFT);
+      off = prior->eval(image, tmp) / prior->getSumAlpha();
       classifier->updateSemi(image, tmp, off);
 
-      priorConfidence = classifierOff->eval(image, trackedPatch) / classifierOff->getSumAlpha();
+      priorConfidence = prior->eval(image, trackedPatch) / prior->getSumAlpha();
       classifier->updateSemi(image, trackedPatch, priorConfidence);
 
-      tmp = patches->getSpecialRect("UpperRight");
-      off = classifierOff->eval(image, tmp) / classifierOff->getSumAlpha();
+      tmp = getNegative(patches, Patches::UPPER_RIGHT);
+      off = prior->eval(image, tmp) / prior->getSumAlpha();
       classifier->updateSemi(image, tmp, off);
 
-      priorConfidence = classifierOff->eval(image, trackedPatch) / classifierOff->getSumAlpha();
+      priorConfidence = prior->eval(image, trackedPatch) / prior->getSumAlpha();
       classifier->updateSemi(image, trackedPatch, priorConfidence);
 
-      tmp = patches->getSpecialRect("LowerRight");
-      off = classifierOff->eval(image, tmp) / classifierOff->getSumAlpha();
+      tmp = getNegative(patches, Patches::LOWER_RIGHT);
+      off = prior->eval(image, tmp) / prior->getSumAlpha();
       classifier->updateSemi(image, tmp, off);
 
-      priorConfidence = classifierOff->eval(image, trackedPatch) / classifierOff->getSumAlpha();
+      priorConfidence = prior->eval(image, trackedPatch) / prior->getSumAlpha();
       classifier->updateSemi(image, trackedPatch, priorConfidence);
 
       return true;
@@ -2323,9 +4391,36 @@ namespace cv
       if (searchRegion.x + searchRegion.width > validROI.width)
         searchRegion.width = validROI.width - searchRegion.x;
 
+      if (!useMotionModel)
+      {
+        imageROI = searchRegion;
+        return searchRegion;
+      }
+
+      trainingROI = searchRegion;
+      searchRegion = motion.getSearchRegion(trackedPatch.size(), searchFactor, validROI);
+      imageROI = trainingROI | searchRegion;
       return searchRegion;
     }
 
+    void
+    SemiBoostingTracker::setMotionModel(bool useMotionModel)
+    {
+      this->useMotionModel = useMotionModel;
+      motion.init(Point2f(trackedPatch.x + 0.5f * trackedPatch.width, trackedPatch.y + 0.5f * trackedPatch.height));
+      motion.predict();
+    }
+
+    Rect
+    SemiBoostingTracker::getNegative(Patches* patches, Patches::SpecialRect corner)
+    {
+      // the search region of the motion model can be close around the patch, the negatives are taken from the
+      // corners of the fixed search region then
+      if (!useMotionModel)
+        return patches->getSpecialRect(corner);
+      return PatchesRegularScan(trainingROI, validROI, trackedPatch.size(), 0.99f).getSpecialRect(corner);
+    }
+
     float
     SemiBoostingTracker::getConfidence()
     {
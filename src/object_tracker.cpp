@@ -41,12 +41,107 @@
 //M*/
 
 #include <iostream>
+#include <fstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "object_tracker.h"
 
 namespace cv
 {
 
+  //---------------------------------------------------------------------------
+  // The 8-bit gray-scale version of image in gray, see TrackingAlgorithm::import_gray_image.  A color
+  // image is converted into gray_buffer.
+  static void
+  convert_to_gray(const cv::Mat & image, const cv::Rect & roi, cv::Mat & gray_buffer, cv::Mat & gray)
+  {
+    // We want the internal version of the image to be gray-scale, so let's
+    // do that here.  We'll handle cases where the input is either RGB, RGBA,
+    // or already gray-scale.  I assume it's already 8-bit.  If not then 
+    // an error is thrown.  I'm not going to deal with converting properly
+    // from every data type since that shouldn't be happening.
+
+    // Make sure the input image pointer is valid
+    if (image.empty())
+    {
+      std::cerr << "convert_to_gray(...) -- ERROR!  Input image pointer is NULL!\n" << std::endl;
+      exit(0); // <--- CV_ERROR?
+    }
+
+    // The algorithms only read the image, so a gray-scale one is shared instead of copied
+    if (image.channels() == 1)
+    {
+      gray = image;
+      return;
+    }
+
+    int code;
+    if (image.channels() == 4)
+    {
+      code = CV_RGBA2GRAY;
+    }
+    else if (image.channels() == 3)
+    {
+      code = CV_RGB2GRAY;
+    }
+    else if (image.channels() == 2)
+    {
+      code = -1;
+    }
+    else
+    {
+      std::cerr << "convert_to_gray(...) -- ERROR!  Invalid number of channels for input image!\n"
+                << std::endl;
+      exit(0);
+    }
+
+    // Only the region the algorithm reads is converted, into a buffer of our own which is kept over the frames
+    gray_buffer.create(image.rows, image.cols, CV_8UC1);
+    cv::Rect convertRegion = roi & cv::Rect(0, 0, image.cols, image.rows);
+    if (convertRegion.width > 0 && convertRegion.height > 0)
+    {
+      cv::Mat grayRegion = gray_buffer(convertRegion);
+      if (code < 0)
+      {
+        // Packed YUYV, the luma is picked from every other byte
+        cv::Mat packedRegion = image(convertRegion);
+        int from_to[] = { 0, 0 };
+        cv::mixChannels(&packedRegion, 1, &grayRegion, 1, from_to, 1);
+      }
+      else
+      {
+        cv::cvtColor(image(convertRegion), grayRegion, code);
+      }
+    }
+    gray = gray_buffer;
+  }
+
+  // The tracking algorithm of the given ObjectTrackerParams::algorithm_
+  static TrackingAlgorithm*
+  create_algorithm(int algorithm)
+  {
+    // Allocate the proper tracking algorithm (note: error-checking that a valid
+    // tracking algorithm parameter is used is done in the ObjectTrackerParams
+    // constructor, so at this point we are confident it's valid).
+    switch (algorithm)
+    {
+      case ObjectTrackerParams::CV_ONLINEBOOSTING:
+        return new OnlineBoostingAlgorithm();
+      case ObjectTrackerParams::CV_SEMIONLINEBOOSTING:
+        return new SemiOnlineBoostingAlgorithm();
+      case ObjectTrackerParams::CV_ONLINEMIL:
+        return new OnlineMILAlgorithm();
+      case ObjectTrackerParams::CV_LINEMOD:
+        return new LINEMODAlgorithm();
+      default:
+        // By default, if an invalid choice somehow gets through lets use online boosting?
+        // Or throw an error and don't continue?
+        return new OnlineBoostingAlgorithm();
+    }
+  }
+
   //---------------------------------------------------------------------------
   ObjectTrackerParams::ObjectTrackerParams()
   {
@@ -60,6 +155,23 @@ namespace cv
     overlap_ = 0.99f;
     search_factor_ = 2.0f;
 
+    // The soft cascade is off by default, with it only the best detection and the detection count are exact. The
+    // rejection thresholds stop more patches early, at the cost of missing detections, even the best one, which
+    // start below all recent positive samples
+    early_termination_ = false;
+    rejection_thresholds_ = false;
+
+    // The whole search region is scanned by default. With a coarse step of 4 to 6 the coarse to fine search
+    // evaluates an order of magnitude fewer patches
+    coarse_step_ = 0;
+    coarse_candidates_ = 3;
+
+    // The search region is the search factor times the tracked patch around it, without a motion model
+    motion_model_ = false;
+
+    // Boosting trackers started with the same seed on the same frames give the same results
+    seed_ = 0xffffffff;
+
     // Defaults for MIL tracker
     pos_radius_train_ = 4.0f;
     neg_num_train_ = 65;
@@ -88,6 +200,12 @@ namespace cv
     // Store information about the searching 
     overlap_ = overlap;
     search_factor_ = search_factor;
+    early_termination_ = false;
+    rejection_thresholds_ = false;
+    coarse_step_ = 0;
+    coarse_candidates_ = 3;
+    motion_model_ = false;
+    seed_ = 0xffffffff;
 
     // MIL parameters
     pos_radius_train_ = pos_radius_train;
@@ -101,6 +219,8 @@ namespace cv
 
   //---------------------------------------------------------------------------
   TrackingAlgorithm::TrackingAlgorithm()
+      :
+        print_confidence_(true)
   {
   }
 
@@ -109,6 +229,74 @@ namespace cv
   {
   }
 
+  //---------------------------------------------------------------------------
+  void
+  TrackingAlgorithm::import_gray_image(const cv::Mat & image, const cv::Rect & roi)
+  {
+    convert_to_gray(image, roi, gray_image_, image_);
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Rect
+  TrackingAlgorithm::import_region(const cv::Size & image_size, const ObjectTrackerParams& params)
+  {
+    return cv::Rect(0, 0, image_size.width, image_size.height);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  TrackingAlgorithm::update_changed(const cv::Mat & image, const cv::Rect & changed_rect,
+                                    const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
+    return update(image, params, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Rect
+  TrackingAlgorithm::prepare_region(const cv::Size & image_size, const ObjectTrackerParams& params)
+  {
+    return cv::Rect(0, 0, image_size.width, image_size.height);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  TrackingAlgorithm::prepare(const cv::Mat & image, const cv::Rect & region, int slot)
+  {
+    // The caller may capture the next frame into the same buffer before this one is tracked.  The copy
+    // keeps the memory of the slot once it has the size of the frames.
+    image.copyTo(prepared_images_[slot]);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  TrackingAlgorithm::track_prepared(int slot, const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
+    return update(prepared_images_[slot], params, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  TrackingAlgorithm::set_print_confidence(bool print_confidence)
+  {
+    print_confidence_ = print_confidence;
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  TrackingAlgorithm::save(std::ostream & os) const
+  {
+    std::cerr << "TrackingAlgorithm::save(...) -- ERROR!  Saving is not supported by this tracking algorithm!\n";
+    return false;
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  TrackingAlgorithm::load(std::istream & is, const ObjectTrackerParams& params)
+  {
+    std::cerr << "TrackingAlgorithm::load(...) -- ERROR!  Loading is not supported by this tracking algorithm!\n";
+    return false;
+  }
+
   //
   //
   //
@@ -121,6 +309,7 @@ namespace cv
         cur_frame_rep_(NULL),
         tracker_lost_(false)
   {
+    prepared_reps_[0] = prepared_reps_[1] = NULL;
   }
 
   //---------------------------------------------------------------------------
@@ -137,6 +326,8 @@ namespace cv
       delete cur_frame_rep_;
       cur_frame_rep_ = NULL;
     }
+
+    release_prepared();
   }
 
   //---------------------------------------------------------------------------
@@ -166,6 +357,7 @@ namespace cv
       delete cur_frame_rep_;
       cur_frame_rep_ = NULL;
     }
+    release_prepared();
 
     // (Re-)Initialize the boosting tracker
     cv::Size imageSize(image_.cols, image_.rows);
@@ -173,7 +365,11 @@ namespace cv
     cv::Rect wholeImage(0, 0, imageSize.width, imageSize.height);
     cv::Rect tracking_rect = init_bounding_box;
     tracking_rect_size_ = cv::Size(tracking_rect.width, tracking_rect.height);
-    tracker_ = new boosting::BoostingTracker(cur_frame_rep_, tracking_rect, wholeImage, params.num_classifiers_);
+    tracker_ = new boosting::BoostingTracker(cur_frame_rep_, tracking_rect, wholeImage, params.num_classifiers_,
+                                             params.seed_);
+    tracker_->setEarlyTermination(params.early_termination_, params.rejection_thresholds_);
+    tracker_->setCoarseToFine(params.coarse_step_, params.coarse_candidates_);
+    tracker_->setMotionModel(params.motion_model_);
 
     // Initialize some useful tracking debugging information
     tracker_lost_ = false;
@@ -186,9 +382,6 @@ namespace cv
   bool
   OnlineBoostingAlgorithm::update(const cv::Mat & image, const ObjectTrackerParams& params, cv::Rect & track_box)
   {
-    // Import the image
-    import_image(image);
-
     // Make sure the tracker has already been successfully initialized
     if (tracker_ == NULL)
     {
@@ -197,24 +390,65 @@ namespace cv
           << std::endl;
       return false;
     }
+    // A tracker loaded from a file gets its frame representation with the first frame
+    cv::Size imageSize(image.cols, image.rows);
     if (cur_frame_rep_ == NULL)
     {
-      std::cerr
-          << "OnlineBoostingAlgorithm::update(...) -- ERROR!  Trying to call update without properly initializing the tracker!\n"
-          << std::endl;
-      return false;
+      cur_frame_rep_ = new boosting::ImageRepresentation(cv::Mat(), imageSize);
+    }
+
+    return track_frame(image, imageSize, cur_frame_rep_, cv::Rect(), params, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  OnlineBoostingAlgorithm::update_changed(const cv::Mat & image, const cv::Rect & changed_rect,
+                                          const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
+    // Without the integral images of the previous frame there is nothing to update
+    if (tracker_ == NULL || cur_frame_rep_ == NULL)
+    {
+      return update(image, params, track_box);
     }
 
+    // The integral tables are kept while they cover the region the tracker reads, and may reach beyond the
+    // region of this frame, so the whole frame is imported
+    tracker_->getTrackingROI(params.search_factor_);
+    cv::Rect imageROI = tracker_->getImageROI();
+    import_gray_image(image, cv::Rect(0, 0, image.cols, image.rows));
+    cur_frame_rep_->setNewImageAndROI(image_, imageROI, changed_rect);
+
+    return track_frame(image, cv::Size(image.cols, image.rows), cur_frame_rep_, imageROI, params, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  OnlineBoostingAlgorithm::track_frame(const cv::Mat & image, const cv::Size & image_size,
+                                       boosting::ImageRepresentation* frame_rep, const cv::Rect & covered,
+                                       const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
     // Calculate the patches within the search region
-    cv::Size imageSize(image_.cols, image_.rows);
+    cv::Size imageSize = image_size;
     cv::Rect wholeImage(0, 0, imageSize.width, imageSize.height);
-    boosting::Patches *trackingPatches;
     cv::Rect searchRegion = tracker_->getTrackingROI(params.search_factor_);
-    trackingPatches = new boosting::PatchesRegularScan(searchRegion, wholeImage, tracking_rect_size_, params.overlap_);
+    boosting::PatchesRegularScan trackingPatches(searchRegion, wholeImage, tracking_rect_size_, params.overlap_);
 
-    cur_frame_rep_->setNewImageAndROI(image_, searchRegion);
+    // Import only the part of the image the tracker reads, unless it is prepared already
+    cv::Rect imageROI = tracker_->getImageROI();
+    if ((imageROI & covered) != imageROI)
+    {
+      // A prepared frame covers all the tracker reads, unless the parameters changed while it was pending
+      if (image.empty())
+      {
+        std::cerr << "OnlineBoostingAlgorithm::track_frame(...) -- ERROR!  The prepared frame does not cover the search region!\n"
+                  << std::endl;
+        return false;
+      }
+      import_gray_image(image, imageROI);
+      frame_rep->setNewImageAndROI(image_, imageROI);
+    }
 
-    if (!tracker_->track(cur_frame_rep_, trackingPatches))
+    if (!tracker_->track(frame_rep, &trackingPatches))
     {
       tracker_lost_ = true;
     }
@@ -223,53 +457,165 @@ namespace cv
       tracker_lost_ = false;
     }
 
-    delete trackingPatches;
-
     // Save the new tracking ROI
     track_box = tracker_->getTrackedPatch();
-    std::cout << "\rTracking confidence = " << tracker_->getConfidence();
+    if (print_confidence_)
+    {
+      std::cout << "\rTracking confidence = " << tracker_->getConfidence();
+    }
 
     // Return success or failure based on whether or not the tracker has been lost
     return !tracker_lost_;
   }
 
   //---------------------------------------------------------------------------
-  void
-  OnlineBoostingAlgorithm::import_image(const cv::Mat & image)
+  bool
+  OnlineBoostingAlgorithm::save(std::ostream & os) const
   {
-    // We want the internal version of the image to be gray-scale, so let's
-    // do that here.  We'll handle cases where the input is either RGB, RGBA,
-    // or already gray-scale.  I assume it's already 8-bit.  If not then 
-    // an error is thrown.  I'm not going to deal with converting properly
-    // from every data type since that shouldn't be happening.
+    if (tracker_ == NULL)
+    {
+      std::cerr << "OnlineBoostingAlgorithm::save(...) -- ERROR!  Trying to save the tracker without initializing it!\n"
+                << std::endl;
+      return false;
+    }
 
-    // Make sure the input image pointer is valid
-    if (image.empty())
+    tracker_->write(os);
+    return !os.fail();
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  OnlineBoostingAlgorithm::load(std::istream & is, const ObjectTrackerParams& params)
+  {
+    boosting::BoostingTracker* tracker = boosting::BoostingTracker::read(is);
+    if (tracker == NULL)
     {
-      std::cerr << "OnlineBoostingAlgorithm::import_image(...) -- ERROR!  Input image pointer is NULL!\n" << std::endl;
-      exit(0); // <--- CV_ERROR?
+      std::cerr << "OnlineBoostingAlgorithm::load(...) -- ERROR!  Invalid tracker data!\n" << std::endl;
+      return false;
     }
 
-    // Now copy it in appropriately as a gray-scale, 8-bit image
-    if (image.channels() == 4)
+    // Replace the current tracker, the frame representation is created again with the next frame
+    if (tracker_ != NULL)
     {
-      cv::cvtColor(image, image_, CV_RGBA2GRAY);
+      delete tracker_;
     }
-    else if (image.channels() == 3)
+    if (cur_frame_rep_ != NULL)
+    {
+      delete cur_frame_rep_;
+      cur_frame_rep_ = NULL;
+    }
+    release_prepared();
+
+    tracker_ = tracker;
+    tracking_rect_size_ = tracker_->getTrackedPatch().size();
+    tracker_->setEarlyTermination(params.early_termination_, params.rejection_thresholds_);
+    tracker_->setCoarseToFine(params.coarse_step_, params.coarse_candidates_);
+    tracker_->setMotionModel(params.motion_model_);
+    tracker_lost_ = false;
+
+    // Return success
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Rect
+  OnlineBoostingAlgorithm::import_region(const cv::Size & image_size, const ObjectTrackerParams& params)
+  {
+    if (tracker_ == NULL)
     {
-      cv::cvtColor(image, image_, CV_RGB2GRAY);
+      return TrackingAlgorithm::import_region(image_size, params);
     }
-    else if (image.channels() == 1)
+
+    // update gets the same search region again
+    tracker_->getTrackingROI(params.search_factor_);
+    return tracker_->getImageROI();
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Rect
+  OnlineBoostingAlgorithm::prepare_region(const cv::Size & image_size, const ObjectTrackerParams& params)
+  {
+    // The motion model may predict the search region anywhere in the frame
+    if (tracker_ == NULL || params.motion_model_)
     {
-      image.copyTo(image_);
+      return TrackingAlgorithm::prepare_region(image_size, params);
     }
-    else
+
+    // The next search region is the search factor times a patch within the current one, so it reaches
+    // at most the search factor minus one halves of the patch size beyond the current one
+    cv::Rect region = import_region(image_size, params);
+    float growth = std::max(params.search_factor_ - 1.0f, 0.0f) / 2;
+    int margin_x = (int) ceil(growth * tracking_rect_size_.width) + 1;
+    int margin_y = (int) ceil(growth * tracking_rect_size_.height) + 1;
+    region = cv::Rect(region.x - margin_x, region.y - margin_y, region.width + 2 * margin_x,
+                      region.height + 2 * margin_y);
+    return region & cv::Rect(0, 0, image_size.width, image_size.height);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  OnlineBoostingAlgorithm::prepare(const cv::Mat & image, const cv::Rect & region, int slot)
+  {
+    // Import and integrate the region before the tracker gets to the frame.  Only the integral images are
+    // kept, so the caller may reuse the buffer of the frame right away.
+    cv::Size imageSize(image.cols, image.rows);
+    prepared_sizes_[slot] = imageSize;
+    prepared_regions_[slot] = region & cv::Rect(0, 0, imageSize.width, imageSize.height);
+    if (prepared_reps_[slot] == NULL)
+    {
+      prepared_reps_[slot] = new boosting::ImageRepresentation(cv::Mat(), imageSize);
+    }
+    if (prepared_regions_[slot].area() > 0)
+    {
+      cv::Mat gray;
+      convert_to_gray(image, prepared_regions_[slot], prepared_gray_images_[slot], gray);
+      prepared_reps_[slot]->setNewImageAndROI(gray, prepared_regions_[slot]);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  OnlineBoostingAlgorithm::track_prepared(int slot, const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
+    if (tracker_ == NULL || prepared_reps_[slot] == NULL)
     {
-      std::cerr << "OnlineBoostingAlgorithm::import_image(...) -- ERROR!  Invalid number of channels for input image!\n"
+      std::cerr << "OnlineBoostingAlgorithm::track_prepared(...) -- ERROR!  No frame prepared for an initialized tracker!\n"
                 << std::endl;
-      exit(0);
+      return false;
+    }
+
+    // The frame representation of update() does not hold the previous frame anymore
+    if (cur_frame_rep_ != NULL)
+    {
+      delete cur_frame_rep_;
+      cur_frame_rep_ = NULL;
+    }
+
+    return track_frame(cv::Mat(), prepared_sizes_[slot], prepared_reps_[slot], prepared_regions_[slot], params,
+                       track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  OnlineBoostingAlgorithm::release_prepared()
+  {
+    for (int slot = 0; slot < 2; slot++)
+    {
+      if (prepared_reps_[slot] != NULL)
+      {
+        delete prepared_reps_[slot];
+        prepared_reps_[slot] = NULL;
+      }
+      prepared_gray_images_[slot].release();
     }
   }
+
+  //---------------------------------------------------------------------------
+  void
+  OnlineBoostingAlgorithm::import_image(const cv::Mat & image)
+  {
+    import_gray_image(image, cv::Rect(0, 0, image.cols, image.rows));
+  }
   //
   //
   //
@@ -282,6 +628,7 @@ namespace cv
         cur_frame_rep_(0),
         tracker_lost_(false)
   {
+    prepared_reps_[0] = prepared_reps_[1] = NULL;
   }
 
   //---------------------------------------------------------------------------
@@ -298,6 +645,8 @@ namespace cv
       delete cur_frame_rep_;
       cur_frame_rep_ = NULL;
     }
+
+    release_prepared();
   }
 
   //---------------------------------------------------------------------------
@@ -327,14 +676,21 @@ namespace cv
       delete cur_frame_rep_;
       cur_frame_rep_ = NULL;
     }
+    release_prepared();
 
     // (Re-)Initialize the boosting tracker
     cv::Size imageSize(image_.cols, image_.rows);
     cur_frame_rep_ = new boosting::ImageRepresentation(image_, imageSize);
+    // the semi-supervised updates and the prior evaluate the tracked patch several times per frame
+    cur_frame_rep_->setUseResponseCache(true);
     cv::Rect wholeImage = cv::Rect(0, 0, imageSize.width, imageSize.height);
     cv::Rect tracking_rect = init_bounding_box;
     tracking_rect_size_ = cv::Size(tracking_rect.width, tracking_rect.height);
-    tracker_ = new boosting::SemiBoostingTracker(cur_frame_rep_, tracking_rect, wholeImage, params.num_classifiers_);
+    tracker_ = new boosting::SemiBoostingTracker(cur_frame_rep_, tracking_rect, wholeImage, params.num_classifiers_,
+                                                 params.seed_);
+    tracker_->setEarlyTermination(params.early_termination_, params.rejection_thresholds_);
+    tracker_->setCoarseToFine(params.coarse_step_, params.coarse_candidates_);
+    tracker_->setMotionModel(params.motion_model_);
 
     // Initialize some useful tracking debugging information
     tracker_lost_ = false;
@@ -347,9 +703,6 @@ namespace cv
   bool
   SemiOnlineBoostingAlgorithm::update(const cv::Mat & image, const ObjectTrackerParams& params, cv::Rect & track_box)
   {
-    // Import the image
-    import_image(image);
-
     // Make sure the tracker has already been successfully initialized
     if (tracker_ == NULL)
     {
@@ -358,24 +711,66 @@ namespace cv
           << std::endl;
       return false;
     }
+    // A tracker loaded from a file gets its frame representation with the first frame
+    cv::Size imageSize(image.cols, image.rows);
     if (cur_frame_rep_ == NULL)
     {
-      std::cerr
-          << "OnlineBoostingAlgorithm::update(...) -- ERROR!  Trying to call update without properly initializing the tracker!\n"
-          << std::endl;
-      return false;
+      cur_frame_rep_ = new boosting::ImageRepresentation(cv::Mat(), imageSize);
+      cur_frame_rep_->setUseResponseCache(true);
+    }
+
+    return track_frame(image, imageSize, cur_frame_rep_, cv::Rect(), params, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  SemiOnlineBoostingAlgorithm::update_changed(const cv::Mat & image, const cv::Rect & changed_rect,
+                                              const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
+    // Without the integral images of the previous frame there is nothing to update
+    if (tracker_ == NULL || cur_frame_rep_ == NULL)
+    {
+      return update(image, params, track_box);
     }
 
+    // The integral tables are kept while they cover the region the tracker reads, and may reach beyond the
+    // region of this frame, so the whole frame is imported
+    tracker_->getTrackingROI(params.search_factor_);
+    cv::Rect imageROI = tracker_->getImageROI();
+    import_gray_image(image, cv::Rect(0, 0, image.cols, image.rows));
+    cur_frame_rep_->setNewImageAndROI(image_, imageROI, changed_rect);
+
+    return track_frame(image, cv::Size(image.cols, image.rows), cur_frame_rep_, imageROI, params, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  SemiOnlineBoostingAlgorithm::track_frame(const cv::Mat & image, const cv::Size & image_size,
+                                           boosting::ImageRepresentation* frame_rep, const cv::Rect & covered,
+                                           const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
     // Calculate the patches within the search region
-    cv::Size imageSize(image_.cols, image_.rows);
+    cv::Size imageSize = image_size;
     cv::Rect wholeImage = cv::Rect(0, 0, imageSize.width, imageSize.height);
-    boosting::Patches *trackingPatches;
     cv::Rect searchRegion = tracker_->getTrackingROI(params.search_factor_);
-    trackingPatches = new boosting::PatchesRegularScan(searchRegion, wholeImage, tracking_rect_size_, params.overlap_);
+    boosting::PatchesRegularScan trackingPatches(searchRegion, wholeImage, tracking_rect_size_, params.overlap_);
 
-    cur_frame_rep_->setNewImageAndROI(image_, searchRegion);
+    // Import only the part of the image the tracker reads, unless it is prepared already
+    cv::Rect imageROI = tracker_->getImageROI();
+    if ((imageROI & covered) != imageROI)
+    {
+      // A prepared frame covers all the tracker reads, unless the parameters changed while it was pending
+      if (image.empty())
+      {
+        std::cerr << "SemiOnlineBoostingAlgorithm::track_frame(...) -- ERROR!  The prepared frame does not cover the search region!\n"
+                  << std::endl;
+        return false;
+      }
+      import_gray_image(image, imageROI);
+      frame_rep->setNewImageAndROI(image_, imageROI);
+    }
 
-    if (!tracker_->track(cur_frame_rep_, trackingPatches))
+    if (!tracker_->track(frame_rep, &trackingPatches))
     {
       tracker_lost_ = true;
     }
@@ -384,54 +779,167 @@ namespace cv
       tracker_lost_ = false;
     }
 
-    delete trackingPatches;
-
     // Save the new tracking ROI
     track_box = tracker_->getTrackedPatch();
-    std::cout << "\rTracking confidence = " << tracker_->getConfidence();
+    if (print_confidence_)
+    {
+      std::cout << "\rTracking confidence = " << tracker_->getConfidence();
+    }
 
     // Return success or failure based on whether or not the tracker has been lost
     return !tracker_lost_;
   }
 
   //---------------------------------------------------------------------------
-  void
-  SemiOnlineBoostingAlgorithm::import_image(const cv::Mat & image)
+  bool
+  SemiOnlineBoostingAlgorithm::save(std::ostream & os) const
   {
-    // We want the internal version of the image to be gray-scale, so let's
-    // do that here.  We'll handle cases where the input is either RGB, RGBA,
-    // or already gray-scale.  I assume it's already 8-bit.  If not then 
-    // an error is thrown.  I'm not going to deal with converting properly
-    // from every data type since that shouldn't be happening.
-
-    // Make sure the input image pointer is valid
-    if (image.empty())
+    if (tracker_ == NULL)
     {
-      std::cerr << "OnlineBoostingAlgorithm::import_image(...) -- ERROR!  Input image pointer is NULL!\n" << std::endl;
-      exit(0); // <--- CV_ERROR?
+      std::cerr << "SemiOnlineBoostingAlgorithm::save(...) -- ERROR!  Trying to save the tracker without initializing it!\n"
+                << std::endl;
+      return false;
     }
 
-    // Now copy it in appropriately as a gray-scale, 8-bit image
-    if (image.channels() == 4)
-    {
-      cv::cvtColor(image, image_, CV_RGBA2GRAY);
-    }
-    else if (image.channels() == 3)
+    tracker_->write(os);
+    return !os.fail();
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  SemiOnlineBoostingAlgorithm::load(std::istream & is, const ObjectTrackerParams& params)
+  {
+    boosting::SemiBoostingTracker* tracker = boosting::SemiBoostingTracker::read(is);
+    if (tracker == NULL)
     {
-      cv::cvtColor(image, image_, CV_RGB2GRAY);
+      std::cerr << "SemiOnlineBoostingAlgorithm::load(...) -- ERROR!  Invalid tracker data!\n" << std::endl;
+      return false;
     }
-    else if (image.channels() == 1)
+
+    // Replace the current tracker, the frame representation is created again with the next frame
+    if (tracker_ != NULL)
     {
-      image.copyTo(image_);
+      delete tracker_;
     }
-    else
+    if (cur_frame_rep_ != NULL)
+    {
+      delete cur_frame_rep_;
+      cur_frame_rep_ = NULL;
+    }
+    release_prepared();
+
+    tracker_ = tracker;
+    tracking_rect_size_ = tracker_->getTrackedPatch().size();
+    tracker_->setEarlyTermination(params.early_termination_, params.rejection_thresholds_);
+    tracker_->setCoarseToFine(params.coarse_step_, params.coarse_candidates_);
+    tracker_->setMotionModel(params.motion_model_);
+    tracker_lost_ = false;
+
+    // Return success
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Rect
+  SemiOnlineBoostingAlgorithm::import_region(const cv::Size & image_size, const ObjectTrackerParams& params)
+  {
+    if (tracker_ == NULL)
+    {
+      return TrackingAlgorithm::import_region(image_size, params);
+    }
+
+    // update gets the same search region again
+    tracker_->getTrackingROI(params.search_factor_);
+    return tracker_->getImageROI();
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Rect
+  SemiOnlineBoostingAlgorithm::prepare_region(const cv::Size & image_size, const ObjectTrackerParams& params)
+  {
+    // The motion model may predict the search region anywhere in the frame
+    if (tracker_ == NULL || params.motion_model_)
     {
-      std::cerr << "OnlineBoostingAlgorithm::import_image(...) -- ERROR!  Invalid number of channels for input image!\n"
+      return TrackingAlgorithm::prepare_region(image_size, params);
+    }
+
+    // The next search region is the search factor times a patch within the current one, so it reaches
+    // at most the search factor minus one halves of the patch size beyond the current one
+    cv::Rect region = import_region(image_size, params);
+    float growth = std::max(params.search_factor_ - 1.0f, 0.0f) / 2;
+    int margin_x = (int) ceil(growth * tracking_rect_size_.width) + 1;
+    int margin_y = (int) ceil(growth * tracking_rect_size_.height) + 1;
+    region = cv::Rect(region.x - margin_x, region.y - margin_y, region.width + 2 * margin_x,
+                      region.height + 2 * margin_y);
+    return region & cv::Rect(0, 0, image_size.width, image_size.height);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  SemiOnlineBoostingAlgorithm::prepare(const cv::Mat & image, const cv::Rect & region, int slot)
+  {
+    // Import and integrate the region before the tracker gets to the frame.  Only the integral images are
+    // kept, so the caller may reuse the buffer of the frame right away.
+    cv::Size imageSize(image.cols, image.rows);
+    prepared_sizes_[slot] = imageSize;
+    prepared_regions_[slot] = region & cv::Rect(0, 0, imageSize.width, imageSize.height);
+    if (prepared_reps_[slot] == NULL)
+    {
+      prepared_reps_[slot] = new boosting::ImageRepresentation(cv::Mat(), imageSize);
+      prepared_reps_[slot]->setUseResponseCache(true);
+    }
+    if (prepared_regions_[slot].area() > 0)
+    {
+      cv::Mat gray;
+      convert_to_gray(image, prepared_regions_[slot], prepared_gray_images_[slot], gray);
+      prepared_reps_[slot]->setNewImageAndROI(gray, prepared_regions_[slot]);
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  SemiOnlineBoostingAlgorithm::track_prepared(int slot, const ObjectTrackerParams& params, cv::Rect & track_box)
+  {
+    if (tracker_ == NULL || prepared_reps_[slot] == NULL)
+    {
+      std::cerr << "SemiOnlineBoostingAlgorithm::track_prepared(...) -- ERROR!  No frame prepared for an initialized tracker!\n"
                 << std::endl;
-      exit(0);
+      return false;
+    }
+
+    // The frame representation of update() does not hold the previous frame anymore
+    if (cur_frame_rep_ != NULL)
+    {
+      delete cur_frame_rep_;
+      cur_frame_rep_ = NULL;
+    }
+
+    return track_frame(cv::Mat(), prepared_sizes_[slot], prepared_reps_[slot], prepared_regions_[slot], params,
+                       track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  SemiOnlineBoostingAlgorithm::release_prepared()
+  {
+    for (int slot = 0; slot < 2; slot++)
+    {
+      if (prepared_reps_[slot] != NULL)
+      {
+        delete prepared_reps_[slot];
+        prepared_reps_[slot] = NULL;
+      }
+      prepared_gray_images_[slot].release();
     }
   }
 
+  //---------------------------------------------------------------------------
+  void
+  SemiOnlineBoostingAlgorithm::import_image(const cv::Mat & image)
+  {
+    import_gray_image(image, cv::Rect(0, 0, image.cols, image.rows));
+  }
+
   //
   //
   //
@@ -499,7 +1007,7 @@ namespace cv
       return false;
     }
 
-    import_image(image);
+    import_gray_image(image, import_region(cv::Size(image.cols, image.rows), params));
 
     // Update tracker
     tracker_.track_frame(image_);
@@ -512,41 +1020,28 @@ namespace cv
   }
 
   //---------------------------------------------------------------------------
-  void
-  OnlineMILAlgorithm::import_image(const cv::Mat & image)
+  cv::Rect
+  OnlineMILAlgorithm::import_region(const cv::Size & image_size, const ObjectTrackerParams& params)
   {
-    // We want the internal version of the image to be gray-scale, so let's
-    // do that here.  We'll handle cases where the input is either RGB, RGBA,
-    // or already gray-scale.  I assume it's already 8-bit.  If not then 
-    // an error is thrown.  I'm not going to deal with converting properly
-    // from every data type since that shouldn't be happening.
-
-    // Make sure the input image pointer is valid
-    if (image.empty())
+    // The tracker searches around its last box and takes its negatives from around the new one, which is at
+    // most a search window away.  Only this part of the image is imported, unless the negatives come from the
+    // whole image.
+    if (!is_initialized || tracker_params_._negsamplestrat == 0)
     {
-      std::cerr << "OnlineBoostingAlgorithm::import_image(...) -- ERROR!  Input image pointer is NULL!\n" << std::endl;
-      exit(0); // <--- CV_ERROR?
+      return TrackingAlgorithm::import_region(image_size, params);
     }
 
-    // Now copy it in appropriately as a gray-scale, 8-bit image
-    if (image.channels() == 4)
-    {
-      cv::cvtColor(image, image_, CV_RGBA2GRAY);
-    }
-    else if (image.channels() == 3)
-    {
-      cv::cvtColor(image, image_, CV_RGB2GRAY);
-    }
-    else if (image.channels() == 1)
-    {
-      image.copyTo(image_);
-    }
-    else
-    {
-      std::cerr << "OnlineBoostingAlgorithm::import_image(...) -- ERROR!  Invalid number of channels for input image!\n"
-                << std::endl;
-      exit(0);
-    }
+    cv::Rect box;
+    tracker_.getTrackBox(box);
+    int margin = (int) ceil(2.5f * tracker_params_._srchwinsz) + 1;
+    return cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin);
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  OnlineMILAlgorithm::import_image(const cv::Mat & image)
+  {
+    import_gray_image(image, cv::Rect(0, 0, image.cols, image.rows));
   }
 
   //
@@ -596,34 +1091,14 @@ namespace cv
   ObjectTracker::ObjectTracker(const ObjectTrackerParams& params)
       :
         initialized_(false),
-        tracker_(NULL)
+        tracker_(NULL),
+        num_submitted_(0),
+        num_tracked_(0)
   {
     // Store configurable parameters internally
     set_params(params);
 
-    // Allocate the proper tracking algorithm (note: error-checking that a valid
-    // tracking algorithm parameter is used is done in the ObjectTrackerParams
-    // constructor, so at this point we are confident it's valid).
-    switch (params.algorithm_)
-    {
-      case ObjectTrackerParams::CV_ONLINEBOOSTING:
-        tracker_ = new OnlineBoostingAlgorithm();
-        break;
-      case ObjectTrackerParams::CV_SEMIONLINEBOOSTING:
-        tracker_ = new SemiOnlineBoostingAlgorithm();
-        break;
-      case ObjectTrackerParams::CV_ONLINEMIL:
-        tracker_ = new OnlineMILAlgorithm();
-        break;
-      case ObjectTrackerParams::CV_LINEMOD:
-        tracker_ = new LINEMODAlgorithm();
-        break;
-      default:
-        // By default, if an invalid choice somehow gets through lets use online boosting?
-        // Or throw an error and don't continue?
-        tracker_ = new OnlineBoostingAlgorithm();
-        break;
-    }
+    tracker_ = create_algorithm(params.algorithm_);
   }
 
   //---------------------------------------------------------------------------
@@ -651,6 +1126,7 @@ namespace cv
     {
       initialized_ = false;
     }
+    num_submitted_ = num_tracked_ = 0;
 
     // Return success or failure
     return success;
@@ -666,6 +1142,11 @@ namespace cv
       std::cerr << "ObjectTracker::update() -- ERROR! The ObjectTracker needs to be initialized before updating.\n";
       return false;
     }
+    if (num_tracked_ < num_submitted_)
+    {
+      std::cerr << "ObjectTracker::update() -- ERROR! A submitted frame has to be flushed before updating.\n";
+      return false;
+    }
 
     // Update the tracker and return whether or not it succeeded
     bool success = tracker_->update(image, tracker_params_, track_box);
@@ -674,6 +1155,205 @@ namespace cv
     return success;
   }
 
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::update(const cv::Mat & image, const cv::Rect & changed_rect, cv::Rect & track_box)
+  {
+    if (!initialized_)
+    {
+      std::cerr << "ObjectTracker::update() -- ERROR! The ObjectTracker needs to be initialized before updating.\n";
+      return false;
+    }
+    if (num_tracked_ < num_submitted_)
+    {
+      std::cerr << "ObjectTracker::update() -- ERROR! A submitted frame has to be flushed before updating.\n";
+      return false;
+    }
+
+    return tracker_->update_changed(image, changed_rect, tracker_params_, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::submit(const cv::Mat & image, ObjectTrackerResult & result)
+  {
+    if (!initialized_)
+    {
+      std::cerr << "ObjectTracker::submit() -- ERROR! The ObjectTracker needs to be initialized before updating.\n";
+      return false;
+    }
+
+    // The region of the frame that is tracked next is known, the one of the new frame depends on its
+    // result, so the new frame is prepared wherever the tracker may read it
+    cv::Rect region = tracker_->prepare_region(cv::Size(image.cols, image.rows), tracker_params_);
+
+    // Prepare the new frame on one thread while the previous one is tracked on the others.  Preparing
+    // takes a small part of the time of a frame, so the tracker keeps all the threads it has in update():
+    // its parallel regions are nested in the section, and the preparing thread comes on top for a short
+    // while.  Without nested parallelism the tracker would be left with a single thread, so the sections
+    // run one after the other then.
+    int slot = num_submitted_ % 2;
+    bool has_result = num_tracked_ < num_submitted_;
+    bool success = false;
+#ifdef _OPENMP
+    int num_threads = omp_get_max_threads();
+    bool nested = omp_get_active_level() + 1 < omp_get_max_active_levels();
+#if _OPENMP < 201811
+    nested = nested && omp_get_nested();
+#endif
+    bool pipelined = has_result && num_threads > 1 && nested;
+#pragma omp parallel sections num_threads(2) if(pipelined)
+#endif
+    {
+#ifdef _OPENMP
+#pragma omp section
+#endif
+      tracker_->prepare(image, region, slot);
+#ifdef _OPENMP
+#pragma omp section
+#endif
+      if (has_result)
+      {
+#ifdef _OPENMP
+        omp_set_num_threads(num_threads);
+#endif
+        success = tracker_->track_prepared(1 - slot, tracker_params_, result.track_box_);
+      }
+    }
+    num_submitted_++;
+
+    if (!has_result)
+    {
+      return false;
+    }
+    result.frame_ = num_tracked_++;
+    result.found_ = success;
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::flush(ObjectTrackerResult & result)
+  {
+    if (num_tracked_ == num_submitted_)
+    {
+      return false;
+    }
+
+    result.found_ = tracker_->track_prepared(num_tracked_ % 2, tracker_params_, result.track_box_);
+    result.frame_ = num_tracked_++;
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::initialize(const unsigned char* data, size_t step, int width, int height, int format,
+                            const CvRect& bounding_box)
+  {
+    cv::Mat image = luma_image(data, step, width, height, format);
+    if (image.empty())
+    {
+      std::cerr << "ObjectTracker::initialize() -- ERROR! Invalid raw frame.\n";
+      return false;
+    }
+
+    return initialize(image, bounding_box);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::update(const unsigned char* data, size_t step, int width, int height, int format,
+                        cv::Rect & track_box)
+  {
+    cv::Mat image = luma_image(data, step, width, height, format);
+    if (image.empty())
+    {
+      std::cerr << "ObjectTracker::update() -- ERROR! Invalid raw frame.\n";
+      return false;
+    }
+
+    return update(image, track_box);
+  }
+
+  //---------------------------------------------------------------------------
+  cv::Mat
+  ObjectTracker::luma_image(const unsigned char* data, size_t step, int width, int height, int format)
+  {
+    if (data == NULL || width <= 0 || height <= 0)
+    {
+      return cv::Mat();
+    }
+
+    // The frame is only read, the header does not own it
+    unsigned char* pixels = const_cast<unsigned char*>(data);
+    switch (format)
+    {
+      case PIXEL_FORMAT_GRAY:
+      case PIXEL_FORMAT_NV12:
+      case PIXEL_FORMAT_NV21:
+      case PIXEL_FORMAT_I420:
+      case PIXEL_FORMAT_YV12:
+        // The Y plane comes first, the chroma planes behind it are not needed
+        if (step < (size_t) width)
+        {
+          return cv::Mat();
+        }
+        return cv::Mat(height, width, CV_8UC1, pixels, step);
+      case PIXEL_FORMAT_YUYV:
+        // Y0 U Y1 V: every pixel is a luma and a chroma byte
+        if (step < 2 * (size_t) width)
+        {
+          return cv::Mat();
+        }
+        return cv::Mat(height, width, CV_8UC2, pixels, step);
+      default:
+        return cv::Mat();
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::save(const std::string & filename) const
+  {
+    if (!initialized_)
+    {
+      std::cerr << "ObjectTracker::save() -- ERROR! The ObjectTracker needs to be initialized before saving.\n";
+      return false;
+    }
+
+    std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!file)
+    {
+      std::cerr << "ObjectTracker::save() -- ERROR! Could not open " << filename << " for writing.\n";
+      return false;
+    }
+
+    return tracker_->save(file);
+  }
+
+  //---------------------------------------------------------------------------
+  bool
+  ObjectTracker::load(const std::string & filename)
+  {
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    if (!file)
+    {
+      std::cerr << "ObjectTracker::load() -- ERROR! Could not open " << filename << " for reading.\n";
+      return false;
+    }
+
+    // A loaded tracker takes the place of initialize(), so update() can work right away
+    bool success = tracker_->load(file, tracker_params_);
+    if (success)
+    {
+      initialized_ = true;
+      num_submitted_ = num_tracked_ = 0;
+    }
+
+    // Return success or failure
+    return success;
+  }
+
   //---------------------------------------------------------------------------
   void
   ObjectTracker::set_params(const ObjectTrackerParams& params)
@@ -681,4 +1361,100 @@ namespace cv
     tracker_params_ = params;
   }
 
+  //
+  //
+  //
+
+  //---------------------------------------------------------------------------
+  MultiObjectTracker::MultiObjectTracker(const ObjectTrackerParams& params)
+      :
+        tracker_params_(params)
+  {
+  }
+
+  //---------------------------------------------------------------------------
+  MultiObjectTracker::~MultiObjectTracker()
+  {
+    for (size_t i = 0; i < targets_.size(); i++)
+    {
+      delete targets_[i];
+    }
+  }
+
+  //---------------------------------------------------------------------------
+  int
+  MultiObjectTracker::add_target(const cv::Mat & image, const CvRect& bounding_box)
+  {
+    // The targets are updated in parallel, so none of them prints its confidence
+    TrackingAlgorithm* target = create_algorithm(tracker_params_.algorithm_);
+    target->set_print_confidence(false);
+    if (!target->initialize(image, tracker_params_, bounding_box))
+    {
+      std::cerr << "MultiObjectTracker::add_target() -- ERROR! The tracker could not be initialized.\n";
+      delete target;
+      return -1;
+    }
+
+    targets_.push_back(target);
+    return (int) targets_.size() - 1;
+  }
+
+  //---------------------------------------------------------------------------
+  void
+  MultiObjectTracker::remove_target(int index)
+  {
+    if (index < 0 || index >= (int) targets_.size())
+    {
+      std::cerr << "MultiObjectTracker::remove_target() -- ERROR! Invalid target index " << index << ".\n";
+      return;
+    }
+
+    delete targets_[index];
+    targets_.erase(targets_.begin() + index);
+  }
+
+  //---------------------------------------------------------------------------
+  int
+  MultiObjectTracker::update(const cv::Mat & image, std::vector<cv::Rect> & track_boxes, std::vector<bool> & found)
+  {
+    int num_targets = (int) targets_.size();
+    track_boxes.resize(num_targets);
+    found.assign(num_targets, false);
+    if (num_targets == 0)
+    {
+      return 0;
+    }
+
+    // Import the frame once for all targets, a color frame only within the union of the regions they read
+    cv::Size image_size(image.cols, image.rows);
+    cv::Rect region = targets_[0]->import_region(image_size, tracker_params_);
+    for (int i = 1; i < num_targets; i++)
+    {
+      region |= targets_[i]->import_region(image_size, tracker_params_);
+    }
+    cv::Mat gray;
+    convert_to_gray(image, region, gray_image_, gray);
+
+    // The targets only share the gray-scale frame then, every boosting tracker builds the integral images of
+    // its own search region.  The MIL tracker keeps static state, its targets are updated one by one.
+    bool parallel = (tracker_params_.algorithm_ == ObjectTrackerParams::CV_ONLINEBOOSTING
+        || tracker_params_.algorithm_ == ObjectTrackerParams::CV_SEMIONLINEBOOSTING);
+    std::vector<unsigned char> target_found(num_targets);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(parallel)
+#endif
+    for (int i = 0; i < num_targets; i++)
+    {
+      target_found[i] = targets_[i]->update(gray, tracker_params_, track_boxes[i]);
+    }
+
+    int num_found = 0;
+    for (int i = 0; i < num_targets; i++)
+    {
+      found[i] = (target_found[i] != 0);
+      num_found += target_found[i];
+    }
+    return num_found;
+  }
+
 }